@@ -4,364 +4,2136 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <array>
+#include <condition_variable>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <memory>
+#include <limits>
+#include <numeric>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
 #include <cstring>
 #include <cmath>
 #include <filesystem>
+#include "Table.h"
+#include "Wal.h"
+#include "PageJournal.h"
+#include "WriteQueue.h"
+#include "ScanPool.h"
+#include "ScanKernels.h"
+#include "PriceIndex.h"
+#include "TitleIndex.h"
+#include "PrefixIndex.h"
+#include "TrigramIndex.h"
+#include "QuantityIndex.h"
+#include "IdFilter.h"
 
 using namespace std;
 
 const string kDbFile = "store.db";
+const string kResizeFile = "store_resize.db";
 const string kBackupFile = "store_backup.db";
+const string kUpgradeFile = "store_upgrade.db";
 const string kCSVFile = "data.csv";
+const string kWalFile = "store.wal";
+const string kJournalFile = "store.journal";
+const string kPriceIndexFile = "store_price.idx";
+const string kTitleIndexFile = "store_title.idx";
+const string kPrefixIndexFile = "store_prefix.idx";
+const string kQuantityIndexFile = "store_quantity.idx";
+
+constexpr int32_t kInitialCapacity = 100;
+constexpr int32_t kMigrateBucketsPerInsert = 2;
+constexpr int32_t kMigrateBlockBuckets = 256;
+constexpr int32_t kHeaderFlushInterval = 1024;
+constexpr int32_t kLockStripes = 64;
+constexpr int32_t kReaderSlots = 64;
+constexpr int32_t kOptimisticRetries = 8;
+constexpr int32_t kScanChunkBuckets = kStreamChunkBuckets;
+constexpr int32_t kScanPartsPerThread = 4;
+constexpr off_t kWalCheckpointBytes = 16 << 20;
 
-struct Record
+enum class Fields { BY_TITLE, BY_PRICE, BY_QUANTITY };
+
+struct DbStats
 {
-    int32_t id;
-    char title[64];
-    double price;
-    int32_t quantity;
-    bool is_deleted;
+    int32_t count;
+    int32_t capacity;
+    bool resizing;
+    int32_t max_probe;
+    double mean_probe;
+    int32_t max_probe_slots;
+    double mean_probe_slots;
+    std::vector<int64_t> probe_histogram;
+    WalStats wal;
+    QueueStats queue;
 };
 
-struct Header
+// std::shared_mutex on glibc prefers readers, so a steady stream of
+// lookups can starve writers forever. A writer holds gate_ while it waits
+// for exclusive access, and new readers queue behind it on the gate.
+class RwMutex
 {
-    int32_t capacity;
-    int32_t count;
+private:
+    std::mutex gate_;
+    std::shared_mutex rw_;
+
+public:
+    void lock()
+    {
+        std::lock_guard<std::mutex> gate(gate_);
+        rw_.lock();
+    }
+
+    void unlock()
+    {
+        rw_.unlock();
+    }
+
+    void lock_shared()
+    {
+        {
+            std::lock_guard<std::mutex> gate(gate_);
+        }
+        rw_.lock_shared();
+    }
+
+    void unlock_shared()
+    {
+        rw_.unlock_shared();
+    }
 };
 
-constexpr int32_t kRecordSize = sizeof(Record);
-constexpr int32_t kHeaderSize = sizeof(Header);
+// Stripe locks held by one operation. They are always taken in ascending
+// stripe order, so two operations can't deadlock.
+class StripeLocks
+{
+private:
+    std::array<RwMutex, kLockStripes>& stripes_;
+    bool shared_;
+    int32_t first_ = 0;
+    int32_t last_ = -1;
+
+public:
+    StripeLocks(std::array<RwMutex, kLockStripes>& stripes, const bool shared)
+        : stripes_(stripes), shared_(shared)
+    {
+    }
+
+    ~StripeLocks()
+    {
+        release();
+    }
 
-enum class Fields { BY_TITLE, BY_PRICE, BY_QUANTITY };
+    StripeLocks(const StripeLocks&) = delete;
+    StripeLocks& operator=(const StripeLocks&) = delete;
+
+    void start(const int32_t stripe)
+    {
+        release();
+        first_ = stripe;
+        last_ = stripe - 1;
+        extendTo(stripe);
+    }
+
+    void extendTo(const int32_t stripe)
+    {
+        while (last_ < stripe)
+        {
+            ++last_;
+
+            if (shared_)
+            {
+                stripes_[last_].lock_shared();
+            }
+            else
+            {
+                stripes_[last_].lock();
+            }
+        }
+    }
+
+    void lockAll()
+    {
+        start(0);
+        extendTo(kLockStripes - 1);
+    }
+
+    void release()
+    {
+        for (; last_ >= first_; --last_)
+        {
+            if (shared_)
+            {
+                stripes_[last_].unlock_shared();
+            }
+            else
+            {
+                stripes_[last_].unlock();
+            }
+        }
+    }
+};
+
+class Database
+{
+private:
+    Backend backend_;
+    SyncMode sync_;
+    HashKind hash_kind_;
+
+    // While a resize is in progress table_ is the new, larger table in
+    // kResizeFile and old_ is the previous one still in kDbFile; every
+    // insert moves the next kMigrateBucketsPerInsert buckets of old_ over.
+    std::unique_ptr<Table> table_;
+    std::unique_ptr<Table> old_;
+    int32_t migrate_cursor_ = 0;
+    std::atomic<int32_t> unflushed_{0};
+
+    // Every acknowledged change is first made durable in kWalFile; the
+    // tables themselves are only forced to disk at checkpoints. Entries
+    // are logical and logged after the table change. A table write that
+    // is cut short can't be redone from them, so the old page of every
+    // bucket changed since the checkpoint is kept in kJournalFile first
+    // (see replayWal).
+    WalOptions wal_options_;
+    Wal wal_;
+    PageJournal journal_;
+
+    // Optional single-writer mode: insert/update/deleteById only enqueue,
+    // and one thread applies them in batches (see applyBatch).
+    WriteQueue queue_;
+
+    // findBy, getAll and deleteBy split the table into ranges of buckets
+    // and scan them on these threads.
+    mutable ScanPool scan_pool_;
+
+    // Secondary indexes refer to records by id, so moving records between
+    // slots or tables (Robin Hood shifts, resize) leaves them alone; see
+    // indexChange().
+    PriceIndex price_index_;
+    TitleIndex title_index_;
+    PrefixIndex prefix_index_;
+    TrigramIndex trigram_index_;
+    QuantityIndex quantity_index_;
+
+    // Ids that aren't live are turned away here before any table access;
+    // see rebuildIdFilter().
+    IdFilter id_filter_;
+    std::atomic<bool> indexes_stale_{false};
+
+    // Lookups and point writes share the table lock and additionally lock
+    // the stripes covering the buckets they touch; stripes are contiguous
+    // ranges of buckets, i.e. ranges of hash(id). Scans lock every stripe
+    // shared. Resize, migration, deleteBy and the file-level operations
+    // hold the table lock exclusively. Waiting for the WAL happens after
+    // all locks are released, so concurrent writers can share one
+    // fdatasync.
+    mutable RwMutex mutex_;
+    mutable std::array<RwMutex, kLockStripes> stripes_;
+
+    // findById normally takes no lock at all and validates against the
+    // per-bucket seqlocks in Table instead. That only guards against point
+    // writers, so exclusive holders also make layout_ odd and wait until
+    // the lookups already running (counted per reader slot to keep them
+    // off one cache line) have left.
+    struct alignas(64) ReaderSlot
+    {
+        std::atomic<int32_t> active{0};
+    };
+
+    mutable std::array<ReaderSlot, kReaderSlots> readers_;
+    mutable std::atomic<uint32_t> layout_{0};
+
+    class ExclusiveLock
+    {
+    private:
+        const Database& db_;
+        std::unique_lock<RwMutex> lock_;
+
+    public:
+        explicit ExclusiveLock(const Database& db) : db_(db), lock_(db.mutex_)
+        {
+            db_.layout_.fetch_add(1);
+
+            for (const ReaderSlot& slot : db_.readers_)
+            {
+                while (slot.active.load() != 0)
+                {
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+        ~ExclusiveLock()
+        {
+            db_.layout_.fetch_add(1, std::memory_order_release);
+        }
+    };
+
+    // Scans read a snapshot instead of locking the whole table. Every point
+    // change gets a version; while at least one scan is open, writers keep
+    // the before-image of each record they change or move (an insert
+    // leaves an "absent" one). A scan at version S walks the table a chunk
+    // of stripes at a time, skips ids that have an entry newer than S and
+    // adds back the oldest such entry per id at the end. Entries are
+    // dropped once no open scan is older than them.
+    struct UndoEntry
+    {
+        uint64_t version;
+        bool present;
+        Record before;
+    };
+
+    struct ChangeTicket
+    {
+        uint64_t version;
+        bool keep_undo;
+    };
+
+    mutable std::mutex mvcc_mutex_;
+    mutable std::condition_variable mvcc_cv_;
+    uint64_t version_ = 0;
+    std::set<uint64_t> in_flight_;
+    mutable std::multiset<uint64_t> snapshots_;
+    mutable std::unordered_map<int32_t, std::vector<UndoEntry>> undo_;
+
+    ChangeTicket openChange()
+    {
+        std::lock_guard<std::mutex> lock(mvcc_mutex_);
+
+        const uint64_t version = ++version_;
+        in_flight_.insert(version);
+
+        return {version, !snapshots_.empty()};
+    }
+
+    void closeChange(const ChangeTicket& ticket, const int32_t id, const std::vector<Record>& before, const bool done)
+    {
+        std::lock_guard<std::mutex> lock(mvcc_mutex_);
+
+        if (ticket.keep_undo && done)
+        {
+            bool had_id = false;
+
+            for (const Record& record : before)
+            {
+                undo_[record.id].push_back({ticket.version, true, record});
+                had_id = had_id || record.id == id;
+            }
+
+            if (!had_id)
+            {
+                undo_[id].push_back({ticket.version, false, Record{}});
+            }
+        }
+
+        in_flight_.erase(ticket.version);
+        mvcc_cv_.notify_all();
+    }
+
+    // Changes numbered up to the snapshot must be complete before the scan
+    // reads anything, later ones keep undo entries.
+    uint64_t openSnapshot() const
+    {
+        std::unique_lock<std::mutex> lock(mvcc_mutex_);
+
+        const uint64_t snapshot = version_;
+        snapshots_.insert(snapshot);
+
+        mvcc_cv_.wait(lock, [&] { return in_flight_.empty() || *in_flight_.begin() > snapshot; });
+
+        return snapshot;
+    }
+
+    void closeSnapshot(const uint64_t snapshot) const
+    {
+        std::lock_guard<std::mutex> lock(mvcc_mutex_);
+
+        snapshots_.erase(snapshots_.find(snapshot));
+
+        if (snapshots_.empty())
+        {
+            undo_.clear();
+            return;
+        }
+
+        const uint64_t oldest = *snapshots_.begin();
+
+        for (auto it = undo_.begin(); it != undo_.end();)
+        {
+            auto& entries = it->second;
+            entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                         [&](const UndoEntry& entry) { return entry.version <= oldest; }),
+                          entries.end());
+
+            it = entries.empty() ? undo_.erase(it) : std::next(it);
+        }
+    }
+
+    // Oldest before-image of id newer than snapshot, nullptr if id hasn't
+    // changed since. Needs mvcc_mutex_.
+    const UndoEntry* undoAfter(const int32_t id, const uint64_t snapshot) const
+    {
+        const auto it = undo_.find(id);
+
+        if (it == undo_.end())
+        {
+            return nullptr;
+        }
+
+        for (const UndoEntry& entry : it->second)
+        {
+            if (entry.version > snapshot)
+            {
+                return &entry;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Splits table into runs of whole scan chunks, one part per task on
+    // the scan pool, and calls f(stream, out) for each chunk of a part;
+    // out collects that part's results, returned in bucket order.
+    template <class T, class F>
+    vector<vector<T>> scanParts(const Table* table, F f) const
+    {
+        const int32_t buckets = table->buckets();
+        const int64_t chunks = (buckets + kScanChunkBuckets - 1) / kScanChunkBuckets;
+        const int64_t parts = std::min<int64_t>(chunks, scan_pool_.size() * kScanPartsPerThread);
+
+        vector<vector<T>> results(parts);
+
+        scan_pool_.run(parts, [&](const size_t part)
+        {
+            const int32_t first = static_cast<int32_t>(chunks * part / parts) * kScanChunkBuckets;
+            const int32_t end = std::min<int64_t>(buckets, chunks * (part + 1) / parts * kScanChunkBuckets);
+
+            Table::BucketStream stream(*table, first, end - first, kScanChunkBuckets);
+
+            while (stream.next())
+            {
+                f(stream, results[part]);
+            }
+        });
+
+        return results;
+    }
+
+    // Every record for which pred holds, as of one point in time. Point
+    // writers keep running meanwhile; only resize, deleteBy and the
+    // file-level operations wait for the scan. select(table, stream, f)
+    // runs the same test on the stream's current chunk (see selector()).
+    template <class P, class S>
+    vector<Record> scanSnapshot(P pred, S select) const
+    {
+        std::shared_lock<RwMutex> lock(mutex_);
+        requireDb();
+
+        const uint64_t snapshot = openSnapshot();
+
+        vector<Record> result;
+        std::unordered_set<int32_t> taken;
+
+        try
+        {
+            for (const Table* table : tables())
+            {
+                // old_ only exists during a migration, when point writes
+                // take the exclusive lock and so can't run beside a scan.
+                const bool striped = table == table_.get();
+                const int32_t buckets = table->buckets();
+
+                const auto parts = scanParts<Record>(table, [&](Table::BucketStream& stream, vector<Record>& out)
+                {
+                    vector<Record> chunk;
+                    {
+                        StripeLocks stripes(stripes_, true);
+
+                        if (striped)
+                        {
+                            stripes.start(stripeOf(stream.first(), buckets));
+                            stripes.extendTo(stripeOf(stream.first() + stream.size() - 1, buckets));
+                        }
+
+                        select(table, stream, [&](int32_t, const Record& record)
+                        {
+                            chunk.push_back(record);
+                        });
+                    }
+
+                    if (chunk.empty())
+                    {
+                        return;
+                    }
+
+                    std::lock_guard<std::mutex> mvcc(mvcc_mutex_);
+
+                    for (const Record& record : chunk)
+                    {
+                        if (undoAfter(record.id, snapshot) == nullptr)
+                        {
+                            out.push_back(record);
+                        }
+                    }
+                });
+
+                for (const auto& part : parts)
+                {
+                    for (const Record& record : part)
+                    {
+                        if (taken.insert(record.id).second)
+                        {
+                            result.push_back(record);
+                        }
+                    }
+                }
+            }
+
+            std::lock_guard<std::mutex> mvcc(mvcc_mutex_);
+
+            for (const auto& [id, entries] : undo_)
+            {
+                const UndoEntry* entry = undoAfter(id, snapshot);
+
+                if (entry != nullptr && entry->present && pred(entry->before) && taken.insert(id).second)
+                {
+                    result.push_back(entry->before);
+                }
+            }
+        }
+        catch (...)
+        {
+            closeSnapshot(snapshot);
+            throw;
+        }
+
+        closeSnapshot(snapshot);
+        return result;
+    }
+
+    static size_t readerSlot()
+    {
+        static thread_local const size_t slot = std::hash<std::thread::id>()(std::this_thread::get_id()) % kReaderSlots;
+        return slot;
+    }
+
+    // Returns false if the lookup has to go through the locks after all:
+    // an exclusive holder is active, or writers kept getting in the way.
+    bool optimisticFind(const int32_t id, int& disk_reads, std::optional<Record>& result) const
+    {
+        struct Visit
+        {
+            std::atomic<int32_t>& active;
+
+            ~Visit()
+            {
+                active.fetch_sub(1, std::memory_order_release);
+            }
+        };
+
+        std::atomic<int32_t>& active = readers_[readerSlot()].active;
+        active.fetch_add(1);
+        const Visit visit{active};
+
+        bool done = false;
+
+        if ((layout_.load() & 1) == 0 && table_->isOpen())
+        {
+            if (!id_filter_.mayContain(id))
+            {
+                disk_reads = 0;
+                result = std::nullopt;
+                done = true;
+            }
+
+            for (int32_t attempt = 0; attempt < kOptimisticRetries && !done; ++attempt)
+            {
+                Record record;
+                disk_reads = 0;
+                int32_t slot = table_->tryFind(id, disk_reads, &record);
+
+                if (slot == -1 && old_)
+                {
+                    slot = old_->tryFind(id, disk_reads, &record);
+                }
+
+                if (slot != kRetry)
+                {
+                    result = slot >= 0 ? std::optional<Record>(record) : std::nullopt;
+                    done = true;
+                }
+            }
+        }
+
+        return done;
+    }
+
+    void requireDb() const
+    {
+        if (!table_->isOpen())
+        {
+            throw std::runtime_error("DB doesn't exist");
+        }
+    }
+
+    // Record counts live in memory; the headers are rewritten every
+    // kHeaderFlushInterval changes (see finishChange) and when the tables
+    // are closed.
+    void noteMutations(const int32_t n = 1)
+    {
+        unflushed_ += n;
+    }
+
+    void flushHeaders()
+    {
+        for (Table* table : tables())
+        {
+            table->flushHeader();
+        }
+        unflushed_ = 0;
+    }
+
+    static WalEntry walEntry(const WalOp op, const int32_t id = 0, const string& title = "",
+                             const double price = 0.0, const int32_t quantity = 0)
+    {
+        WalEntry entry{};
+        entry.op = op;
+        entry.id = id;
+        entry.quantity = quantity;
+        entry.price = price;
+
+        std::strncpy(entry.title, title.c_str(), sizeof(entry.title));
+        entry.title[sizeof(entry.title) - 1] = '\0';
+
+        return entry;
+    }
+
+    // Called right after the change is applied, while its stripe (or the
+    // exclusive lock) is still held. Log order therefore matches table order
+    // for each id, not globally: changes to ids on different stripes can
+    // reach the log in either order, which replay doesn't care about.
+    uint64_t logChange(const WalEntry& entry)
+    {
+        return wal_options_.enabled ? wal_.append(entry) : 0;
+    }
+
+    // Runs after every change with no locks held: waits for its WAL entry,
+    // then does any due header flush or checkpoint under the exclusive lock.
+    void finishChange(const uint64_t lsn)
+    {
+        if (lsn != 0)
+        {
+            wal_.commit(lsn);
+        }
+
+        if (unflushed_ >= kHeaderFlushInterval || wal_.size() >= kWalCheckpointBytes)
+        {
+            ExclusiveLock lock(*this);
+
+            if (wal_.size() >= kWalCheckpointBytes)
+            {
+                checkpoint();
+            }
+            else if (unflushed_ >= kHeaderFlushInterval && table_->isOpen())
+            {
+                flushHeaders();
+            }
+        }
+    }
+
+    int32_t stripeOf(const int32_t bucket, const int32_t buckets) const
+    {
+        return buckets <= kLockStripes ? bucket
+                                       : static_cast<int32_t>(static_cast<int64_t>(bucket) * kLockStripes / buckets);
+    }
+
+    // Locks the stripes of every bucket a point operation on id can touch
+    // (see Table::homeOf). A span that would wrap past the last bucket, or
+    // runs longer than any insert may probe, locks everything instead.
+    void lockSpan(const Table& table, const int32_t id, StripeLocks& locks) const
+    {
+        const int32_t buckets = table.buckets();
+        int32_t b = table.homeOf(id);
+
+        locks.start(stripeOf(b, buckets));
+
+        for (int32_t step = 0; !table.hasRoom(b); ++step)
+        {
+            if (b + 1 == buckets || step > kMaxDistance)
+            {
+                locks.lockAll();
+                return;
+            }
+
+            ++b;
+            locks.extendTo(stripeOf(b, buckets));
+        }
+
+        if (b + 1 == buckets)
+        {
+            locks.lockAll();
+            return;
+        }
+
+        locks.extendTo(stripeOf(b + 1, buckets));
+    }
+
+    // A change that threw may have left the indexes stale (see
+    // indexChange); they are rebuilt right away rather than at the next
+    // checkpoint.
+    void afterFailedChange()
+    {
+        if (indexes_stale_)
+        {
+            ExclusiveLock lock(*this);
+            repairIndexes();
+        }
+    }
+
+    // Point changes run under the shared table lock plus the stripes of
+    // the key's span, so writes to different parts of the table proceed in
+    // parallel. change(false, before) returns std::nullopt when it needs
+    // the whole table (a resize); while a migration is in progress, or if
+    // it gave up, change(true, nullptr) runs under the exclusive lock
+    // instead, where no scan can be open. If before is given, it gets the
+    // old contents of every record the change rewrote or moved.
+    template <class F>
+    bool pointChange(const int32_t id, const WalEntry& entry, F change)
+    {
+        std::optional<bool> done;
+        uint64_t lsn = 0;
+
+        try
+        {
+            {
+                std::shared_lock<RwMutex> lock(mutex_);
+
+                if (!old_ && table_->isOpen())
+                {
+                    StripeLocks stripes(stripes_, false);
+                    lockSpan(*table_, id, stripes);
+
+                    const ChangeTicket ticket = openChange();
+                    std::vector<Record> before;
+
+                    try
+                    {
+                        done = change(false, ticket.keep_undo ? &before : nullptr);
+                    }
+                    catch (...)
+                    {
+                        closeChange(ticket, id, before, false);
+                        throw;
+                    }
+
+                    closeChange(ticket, id, before, done == true);
+
+                    if (done == true)
+                    {
+                        lsn = logChange(entry);
+                    }
+                }
+            }
+
+            if (!done)
+            {
+                ExclusiveLock lock(*this);
+
+                done = change(true, nullptr);
+
+                if (*done)
+                {
+                    lsn = logChange(entry);
+                }
+            }
+        }
+        catch (...)
+        {
+            afterFailedChange();
+            throw;
+        }
+
+        finishChange(lsn);
+        return *done;
+    }
+
+    static Record makeRecord(const int32_t id, const string& title, const double price, const int32_t quantity)
+    {
+        Record record{};
+        record.is_deleted = false;
+        record.id = id;
+
+        std::strncpy(record.title, title.c_str(), sizeof(record.title));
+        record.title[sizeof(record.title) - 1] = '\0';
+
+        record.price = price;
+        record.quantity = quantity;
+
+        return record;
+    }
+
+    void checkpoint()
+    {
+        if (!table_->isOpen())
+        {
+            return;
+        }
+
+        flushHeaders();
+
+        for (const Table* table : tables())
+        {
+            table->flush();
+        }
+
+        resetJournal();
+
+        if (!repairIndexes())
+        {
+            return;
+        }
+
+        price_index_.flush();
+        title_index_.flush();
+        prefix_index_.flush();
+        quantity_index_.flush();
+
+        if (wal_.isOpen())
+        {
+            wal_.reset();
+        }
+    }
+
+    // Every change of a record goes through here to keep the secondary
+    // indexes up to date: before is nullptr for an insert, after for a
+    // delete. If an index fails half way, the indexes no longer match the
+    // table and are marked stale (see repairIndexes).
+    void indexChange(const Record* before, const Record* after)
+    {
+        try
+        {
+            updateIndexes(before, after);
+        }
+        catch (...)
+        {
+            indexes_stale_ = true;
+            throw;
+        }
+    }
+
+    void updateIndexes(const Record* before, const Record* after)
+    {
+        const bool both = before != nullptr && after != nullptr;
+        const bool same_price = both && before->price == after->price;
+        const bool same_title = both && strcmp(before->title, after->title) == 0;
+        const bool same_quantity = both && before->quantity == after->quantity;
+
+        if (before != nullptr)
+        {
+            if (!same_price)
+            {
+                price_index_.erase(before->price, before->id);
+            }
+            if (!same_title)
+            {
+                title_index_.erase(before->title, before->id);
+                prefix_index_.erase(before->title);
+                trigram_index_.erase(before->title);
+            }
+            if (!same_quantity)
+            {
+                quantity_index_.erase(before->quantity, before->id);
+            }
+        }
+        if (after != nullptr)
+        {
+            if (!same_price)
+            {
+                price_index_.insert(after->price, after->id);
+            }
+            if (!same_title)
+            {
+                title_index_.insert(after->title, after->id);
+                prefix_index_.insert(after->title);
+                trigram_index_.insert(after->title);
+            }
+            if (!same_quantity)
+            {
+                quantity_index_.insert(after->quantity, after->id);
+            }
+        }
+    }
+
+    // Applies a record change through change(), which returns whether the
+    // table took it. The indexes are updated first, so an index that
+    // fails leaves the table untouched and the caller's error means
+    // nothing changed; if the table then refuses the change or throws,
+    // the indexes are put back. The id filter is the exception: an id has
+    // to be in it before its record becomes visible and may only leave
+    // once the record is gone, or a lock-free lookup could miss a live
+    // record.
+    template <class F>
+    bool changeIndexed(const Record* before, const Record* after, F change)
+    {
+        indexChange(before, after);
+
+        if (before == nullptr)
+        {
+            id_filter_.add(after->id);
+        }
+
+        bool applied = false;
+
+        try
+        {
+            applied = change();
+        }
+        catch (...)
+        {
+            undoIndexChange(before, after);
+            throw;
+        }
+
+        if (!applied)
+        {
+            undoIndexChange(before, after);
+        }
+        else if (after == nullptr)
+        {
+            id_filter_.remove(before->id);
+        }
+
+        return applied;
+    }
+
+    void undoIndexChange(const Record* before, const Record* after)
+    {
+        if (before == nullptr)
+        {
+            id_filter_.remove(after->id);
+        }
+
+        indexChange(after, before);
+    }
+
+    // Rebuilds the indexes if a failed change left them stale; needs the
+    // exclusive lock. Returns false if they are still stale.
+    bool repairIndexes()
+    {
+        if (indexes_stale_)
+        {
+            try
+            {
+                rebuildIndexes();
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "Couldn't rebuild indexes: " << e.what() << std::endl;
+            }
+        }
+
+        return !indexes_stale_;
+    }
+
+    void rebuildIndexes()
+    {
+        std::vector<PriceKey> prices;
+        std::vector<TitleEntry> titles;
+        std::vector<string> names;
+        std::vector<std::pair<int32_t, int32_t>> quantities;
+        prices.reserve(count());
+        titles.reserve(count());
+        names.reserve(count());
+        quantities.reserve(count());
+
+        for (const Table* table : tables())
+        {
+            table->forEachLive([&](int32_t, const Record& record)
+            {
+                prices.push_back({record.price, record.id});
+                titles.push_back({TitleIndex::hash(record.title), record.id, 0});
+                names.emplace_back(record.title);
+                quantities.emplace_back(record.quantity, record.id);
+            });
+        }
+
+        price_index_.rebuild(std::move(prices));
+        title_index_.rebuild(std::move(titles));
+        prefix_index_.rebuild(std::move(names));
+        trigram_index_.rebuild(prefix_index_.complete("", 0));
+        quantity_index_.rebuild(quantities);
+        rebuildIdFilter();
+
+        indexes_stale_ = false;
+    }
+
+    // The quantity index holds every live id, so the filter is refilled
+    // from memory, without reading the table; it is sized for the
+    // capacity of table_, hence rebuilt whenever that grows.
+    void rebuildIdFilter()
+    {
+        id_filter_.rebuild(table_->capacity(), quantity_index_.matching(std::numeric_limits<int32_t>::min(),
+                                                                        std::numeric_limits<int32_t>::max()));
+    }
+
+    // Indexes that weren't closed cleanly or don't match the table are
+    // rebuilt from it; with rebuild set, all of them are. Whatever the
+    // table went through (drop() closes the indexes), this leaves them
+    // open and in line with it.
+    void openIndexes(const bool rebuild = false)
+    {
+        const bool price_ok = price_index_.open() && price_index_.entries() == count();
+        const bool title_ok = title_index_.open() && title_index_.entries() == count();
+        const bool prefix_ok = prefix_index_.open() && prefix_index_.entries() == count();
+        const bool quantity_ok = quantity_index_.open() && quantity_index_.entries() == count();
+
+        if (rebuild || !price_ok || !title_ok || !prefix_ok || !quantity_ok)
+        {
+            rebuildIndexes();
+        }
+        else
+        {
+            trigram_index_.rebuild(prefix_index_.complete("", 0));
+            rebuildIdFilter();
+        }
+    }
+
+    // Re-applies the log on top of the table files. A Robin Hood move,
+    // backward shift or migration block rewrites several pages with
+    // separate writes, and a crash can leave any subset of them on disk,
+    // losing records no entry describes. So by now the constructor has
+    // put back the journal's pages, which leaves the files as they were at
+    // the last checkpoint, where this log starts. Every op is idempotent
+    // all the same (a crash after the journal is reset but before the log
+    // is leaves newer files behind): inserts and updates both write the
+    // whole record whether or not the id is there, deletes of missing
+    // records are no-ops. Updates can't be skipped for a missing id, since
+    // a delete by field replayed before them may have removed a record
+    // that only matched because of the update itself.
+    void replayWal()
+    {
+        const int64_t applied = wal_.replay([&](const WalEntry& entry)
+        {
+            const string title(entry.title);
+
+            switch (entry.op)
+            {
+            case WalOp::INSERT:
+            case WalOp::UPDATE:
+                if (!updateRecord(entry.id, title, entry.price, entry.quantity))
+                {
+                    insertRecord(entry.id, title, entry.price, entry.quantity);
+                }
+                break;
+            case WalOp::DELETE_ID:
+                eraseById(entry.id);
+                break;
+            case WalOp::DELETE_TITLE:
+                deleteBy(title, Fields::BY_TITLE);
+                break;
+            case WalOp::DELETE_PRICE:
+                deleteBy(entry.price, Fields::BY_PRICE);
+                break;
+            case WalOp::DELETE_QUANTITY:
+                deleteBy(entry.quantity, Fields::BY_QUANTITY);
+                break;
+            }
+        });
+
+        if (applied > 0)
+        {
+            cout << "Replayed " << applied << " WAL entries" << endl;
+        }
+
+        checkpoint();
+    }
+
+    int32_t count() const
+    {
+        return table_->count() + (old_ ? old_->count() : 0);
+    }
+
+    std::unique_ptr<Table> makeTable(const string& path)
+    {
+        auto table = std::make_unique<Table>(path, backend_, sync_, hash_kind_);
+
+        table->setBeforeWrite([this](const Table& owner, const std::vector<int32_t>& buckets)
+        {
+            if (journal_.isOpen())
+            {
+                journal_.save(owner, buckets);
+            }
+        });
+
+        return table;
+    }
+
+    // Only once every table is on disk (or about to be replaced).
+    void resetJournal()
+    {
+        journal_.reset();
+
+        for (Table* table : tables())
+        {
+            table->forgetSaved();
+        }
+    }
+
+    void createNew(const int32_t new_capacity)
+    {
+        abortMigration();
+
+        table_->create(new_capacity);
+    }
+
+    // A file still in the flat layout of earlier versions is converted
+    // once: its live records go into a fresh bucketed table, which then
+    // replaces it. Until the rename the old file is left as it was, so an
+    // interrupted conversion simply starts over.
+    void upgradeLegacyFile(const string& path)
+    {
+        LegacyHeader header{};
+
+        if (!Table::isLegacyFile(path, header))
+        {
+            return;
+        }
+
+        cout << "Converting " << path << " from the old flat format..." << endl;
+
+        Table upgraded(kUpgradeFile, backend_, sync_, hash_kind_);
+        upgraded.create(std::max(kInitialCapacity, header.capacity));
+
+        Table::readLegacyFile(path, [&](const std::vector<Record>& records) { upgraded.insertMany(records); });
+
+        upgraded.flush();
+        upgraded.close();
+        std::filesystem::rename(kUpgradeFile, path);
+    }
+
+    void abortMigration()
+    {
+        if (old_)
+        {
+            old_.reset();
+            table_->close();
+            std::filesystem::remove(kResizeFile);
+            table_ = makeTable(kDbFile);
+        }
+        migrate_cursor_ = 0;
+
+        // Whatever the journal holds belongs to files that are about to
+        // be replaced or removed.
+        resetJournal();
+    }
+
+    // Moves the next max_buckets buckets of old_ into table_. Interleaved with
+    // regular requests the moved records must be tombstoned in old_, so a
+    // delete that lands in table_ can't be undone by resuming later; when
+    // draining nothing else runs and old_ is left untouched until the
+    // rename replaces it.
+    void migrateBlock(const int32_t max_buckets, const bool tombstone_old)
+    {
+        const int32_t n = std::min(max_buckets, old_->buckets() - migrate_cursor_);
+
+        std::vector<Bucket> block(n);
+        old_->readBuckets(migrate_cursor_, n, block.data());
+
+        std::vector<Record> live;
+
+        for (const auto& bucket : block)
+        {
+            for (uint64_t full = matchFull(bucket.ctrl); full != 0; full &= full - 1)
+            {
+                live.push_back(bucket.slots[lowestBit(full)]);
+            }
+        }
+
+        table_->insertMany(live);
+
+        if (tombstone_old)
+        {
+            old_->eraseBuckets(migrate_cursor_, n);
+        }
+
+        migrate_cursor_ += n;
+    }
+
+    void migrateStep(const int32_t max_buckets)
+    {
+        if (!old_)
+        {
+            return;
+        }
+
+        migrateBlock(max_buckets, true);
+
+        if (migrate_cursor_ == old_->buckets())
+        {
+            finishMigration();
+        }
+    }
+
+    void finishMigration()
+    {
+        if (!old_)
+        {
+            return;
+        }
+
+        while (migrate_cursor_ < old_->buckets())
+        {
+            migrateBlock(kMigrateBlockBuckets, false);
+        }
+
+        // The saved pages are named by file, so they can't survive the
+        // rename; both tables go to disk first instead.
+        table_->flush();
+        old_->flush();
+        resetJournal();
+
+        old_.reset();
+        table_->renameTo(kDbFile);
+        migrate_cursor_ = 0;
+    }
+
+    void resize()
+    {
+        cout << "Resizing..." << endl;
+
+        finishMigration();
+
+        // Flushed right away: after a crash the journal can only put its
+        // pages back if the file and its header are there.
+        auto next = makeTable(kResizeFile);
+        next->create(2 * table_->capacity());
+        next->flush();
+
+        old_ = std::move(table_);
+        old_->setDraining(true);
+        table_ = std::move(next);
+        migrate_cursor_ = 0;
+
+        rebuildIdFilter();
+    }
+
+    int32_t findSlot(const int32_t id, Table*& owner, int& disk_reads, Record* out = nullptr) const
+    {
+        owner = table_.get();
+
+        if (!id_filter_.mayContain(id))
+        {
+            return -1;
+        }
+
+        int32_t slot = table_->find(id, disk_reads, out);
+
+        if (slot < 0 && old_)
+        {
+            owner = old_.get();
+            slot = old_->find(id, disk_reads, out);
+        }
+
+        return slot;
+    }
+
+    vector<Table*> tables() const
+    {
+        vector<Table*> result{table_.get()};
+
+        if (old_)
+        {
+            result.push_back(old_.get());
+        }
+
+        return result;
+    }
+
+    template <class T>
+    static bool matches(const Record& record, const T& field, const Fields field_type)
+    {
+        if constexpr (std::is_same_v<T, double>)
+        {
+            return field_type == Fields::BY_PRICE && fabs(record.price - field) < 1e-9;
+        }
+        else if constexpr (std::is_same_v<T, int32_t>)
+        {
+            return field_type == Fields::BY_QUANTITY && record.quantity == field;
+        }
+        else if constexpr (std::is_same_v<T, std::string>)
+        {
+            return field_type == Fields::BY_TITLE && strcmp(record.title, field.c_str()) == 0;
+        }
+        else
+        {
+            static_assert(sizeof(T) == 0, "Unsupported type passed to findBy()");
+        }
+    }
+
+    // matches() as a scan: the result, called as select(table, stream, f),
+    // calls f(slot, record) for every live match in the stream's current
+    // chunk. Prices and quantities are tested on the table's shadow
+    // columns, which only needs the pages holding a match, titles on the
+    // records read through the stream; both with the kernels from
+    // ScanKernels.h.
+    template <class T>
+    static auto selector(const T& field, const Fields field_type)
+    {
+        const ScanKernels& kernels = scanKernels();
+
+        if constexpr (std::is_same_v<T, double>)
+        {
+            const bool active = field_type == Fields::BY_PRICE;
+
+            return [active, field, kernel = kernels.price](const Table* table, Table::BucketStream& stream, auto f)
+            {
+                table->forEachColumnMatchIn(stream.first(), stream.size(), [&](const double* prices, const int32_t*)
+                {
+                    return active ? kernel(prices, kBucketSlots, field) : 0;
+                }, f);
+            };
+        }
+        else if constexpr (std::is_same_v<T, int32_t>)
+        {
+            const bool active = field_type == Fields::BY_QUANTITY;
+
+            return [active, field, kernel = kernels.quantity](const Table* table, Table::BucketStream& stream,
+                                                              auto f)
+            {
+                table->forEachColumnMatchIn(stream.first(), stream.size(), [&](const double*, const int32_t* quantities)
+                {
+                    return active ? kernel(quantities, kBucketSlots, field) : 0;
+                }, f);
+            };
+        }
+        else if constexpr (std::is_same_v<T, std::string>)
+        {
+            // Stored titles are shorter than kTitleSize, so a longer query
+            // can't match anything.
+            const size_t len = strlen(field.c_str());
+            const bool active = field_type == Fields::BY_TITLE && len < kTitleSize;
+
+            std::array<char, kTitleSize> title{};
+            std::memcpy(title.data(), field.c_str(), std::min(len, kTitleSize - 1));
+
+            return [active, title, len, kernel = kernels.title](const Table* table, Table::BucketStream& stream,
+                                                                auto f)
+            {
+                table->forEachMatch(stream, [&](const Record* slots)
+                {
+                    return active ? kernel(slots, kBucketSlots, title.data(), len) : 0;
+                }, f);
+            };
+        }
+        else
+        {
+            static_assert(sizeof(T) == 0, "Unsupported type passed to findBy()");
+        }
+    }
+
+    template <class T>
+    vector<Record> findBy(const T& field, const Fields field_type) const
+    {
+        return scanSnapshot([&](const Record& record)
+        {
+            return matches(record, field, field_type);
+        }, selector(field, field_type));
+    }
+
+    template <class T>
+    int32_t deleteBy(const T& field, const Fields field_type)
+    {
+        requireDb();
+
+        if constexpr (std::is_same_v<T, std::string>)
+        {
+            return deleteByIds(title_index_.find(field), field, field_type);
+        }
+        else if constexpr (std::is_same_v<T, int32_t>)
+        {
+            return deleteByIds(idsOf(quantity_index_.matching(field, field)), field, field_type);
+        }
+
+        int32_t count = 0;
+        const auto select = selector(field, field_type);
+
+        for (Table* table : tables())
+        {
+            const auto parts = scanParts<Record>(table, [&](Table::BucketStream& stream, vector<Record>& found)
+            {
+                select(table, stream, [&](int32_t, const Record& record)
+                {
+                    found.push_back(record);
+                });
+            });
+
+            // Erasing shifts records between slots (and across part
+            // boundaries), so it stays on this thread and looks each one
+            // up again.
+            for (const auto& found : parts)
+            {
+                for (const Record& record : found)
+                {
+                    const int32_t slot = table->find(record.id);
+
+                    if (slot >= 0)
+                    {
+                        changeIndexed(&record, nullptr, [&] { table->erase(slot); return true; });
+                        ++count;
+                    }
+                }
+            }
+        }
+
+        noteMutations(count);
+
+        return count;
+    }
+
+    static vector<int32_t> idsOf(const RoaringBitmap& bitmap)
+    {
+        vector<int32_t> ids;
+        bitmap.forEach([&](const uint32_t id) { ids.push_back(static_cast<int32_t>(id)); });
+        return ids;
+    }
+
+    // The records carrying each of titles in turn, each title's ones by
+    // id, up to limit (0 means no limit). Ids come from the title index;
+    // records that changed their title meanwhile are skipped.
+    vector<Record> recordsWithTitles(const vector<string>& titles, const size_t limit) const
+    {
+        vector<Record> result;
+
+        for (const string& title : titles)
+        {
+            for (const int32_t id : title_index_.find(title))
+            {
+                if (limit != 0 && result.size() == limit)
+                {
+                    return result;
+                }
+
+                int disk_reads = 0;
+                const std::optional<Record> record = findById(id, disk_reads);
+
+                if (record && title == record->title)
+                {
+                    result.push_back(*record);
+                }
+            }
+        }
+
+        return result;
+    }
+
+    // deleteBy() for candidates taken from an index: each id is looked up
+    // and only erased if its record really matches.
+    template <class T>
+    int32_t deleteByIds(const vector<int32_t>& ids, const T& field, const Fields field_type)
+    {
+        int32_t count = 0;
+
+        for (const int32_t id : ids)
+        {
+            Table* owner = nullptr;
+            int disk_reads = 0;
+            Record record;
+            const int32_t slot = findSlot(id, owner, disk_reads, &record);
+
+            if (slot >= 0 && matches(record, field, field_type))
+            {
+                changeIndexed(&record, nullptr, [&] { owner->erase(slot); return true; });
+                ++count;
+            }
+        }
+
+        noteMutations(count);
+
+        return count;
+    }
+
+    bool insertRecord(const int32_t id, const string& title, const double price, const int32_t quantity)
+    {
+        if (id <= 0)
+        {
+            return false;
+        }
+
+        requireDb();
 
-class Database
-{
-private:
-    int32_t capacity_;
-    int32_t count_;
+        migrateStep(kMigrateBucketsPerInsert);
 
-    int32_t hash(const int32_t id) const
-    {
-        if (capacity_ == 0)
+        if (count() > table_->capacity() * 0.7)
         {
-            throw std::runtime_error("DB doesn't exist");
+            resize();
         }
-        return std::abs(id) % capacity_;
-    }
 
-    void writeHeader() const
-    {
-        std::fstream file(kDbFile, std::ios::binary | std::ios::in | std::ios::out);
+        Table* owner = nullptr;
+        int disk_reads = 0;
 
-        if (!file.is_open())
+        if (findSlot(id, owner, disk_reads) >= 0)
         {
-            throw std::runtime_error("File for db didn't open");
+            return false;
         }
 
-        Header header{capacity_, count_};
-
-        file.seekp(0, std::ios::beg);
-        file.write(reinterpret_cast<char*>(&header), kHeaderSize);
+        const Record record = makeRecord(id, title, price, quantity);
+        InsertStatus status = InsertStatus::OK;
 
-        file.close();
-    }
+        changeIndexed(nullptr, &record, [&]
+        {
+            status = table_->insert(record);
+            return status == InsertStatus::OK;
+        });
 
-    void createNew(const int32_t new_capacity)
-    {
-        std::ofstream out(kDbFile, std::ios::binary);
+        if (status == InsertStatus::FULL)
+        {
+            resize();
+            return insertRecord(id, title, price, quantity);
+        }
 
-        if (!out.is_open())
+        if (status != InsertStatus::OK)
         {
-            throw std::runtime_error("File for db didn't open");
+            return false;
         }
 
-        Header header{new_capacity, 0};
-        out.write(reinterpret_cast<char*>(&header), kHeaderSize);
+        noteMutations();
+        return true;
+    }
 
-        capacity_ = new_capacity;
-        count_ = 0;
+    bool updateRecord(const int32_t id, const string& new_title, const double new_price, const int32_t new_quantity,
+                      std::vector<Record>* before = nullptr)
+    {
+        if (!table_->isOpen())
+        {
+            return false;
+        }
 
+        Table* owner = nullptr;
+        int disk_reads = 0;
         Record record;
-        record.id = 0;
-        record.is_deleted = true;
+        const int32_t slot = findSlot(id, owner, disk_reads, &record);
 
-        for (int32_t count = 0; count < new_capacity; ++count)
+        if (slot < 0)
         {
-            out.write(reinterpret_cast<char*>(&record), kRecordSize);
+            return false;
+        }
+
+        if (before != nullptr)
+        {
+            before->push_back(record);
         }
 
-        out.close();
+        const Record old = record;
+
+        std::strncpy(record.title, new_title.c_str(), sizeof(record.title));
+        record.title[sizeof(record.title) - 1] = '\0';
+        record.price = new_price;
+        record.quantity = new_quantity;
+
+        return changeIndexed(&old, &record, [&] { owner->writeRecord(slot, record); return true; });
     }
 
-    void resize()
+    bool eraseById(const int32_t id, std::vector<Record>* before = nullptr)
     {
-        cout << "Resizing..." << endl;
-        std::vector<Record> records = getAll();
+        requireDb();
 
-        createNew(2 * capacity_);
+        Table* owner = nullptr;
+        int disk_reads = 0;
+        Record record;
+        const int32_t slot = findSlot(id, owner, disk_reads, &record);
 
-        for (const auto& record : records)
+        if (slot < 0)
         {
-            insert(record.id, record.title, record.price, record.quantity);
+            return false;
         }
+
+        changeIndexed(&record, nullptr, [&] { owner->erase(slot, before); return true; });
+        noteMutations();
+        return true;
     }
 
     template <class T>
-    vector<Record> findBy(const T& field, const Fields field_type) const
+    int32_t deleteLogged(const T& field, const Fields field_type, const WalEntry& entry)
     {
-        if (capacity_ == 0)
+        int32_t deleted = 0;
+        uint64_t lsn = 0;
+        try
         {
-            throw std::runtime_error("DB doesn't exist");
+            ExclusiveLock lock(*this);
+
+            deleted = deleteBy(field, field_type);
+
+            if (deleted > 0)
+            {
+                lsn = logChange(entry);
+            }
+        }
+        catch (...)
+        {
+            afterFailedChange();
+            throw;
         }
-        vector<Record> result;
 
-        std::ifstream in(kDbFile, std::ios::binary);
+        finishChange(lsn);
+        return deleted;
+    }
 
-        if (!in.is_open())
+    static WalEntry walEntry(const QueuedWrite& write)
+    {
+        switch (write.op)
         {
-            throw std::runtime_error("File for db didn't open to find by field");
+        case QueuedOp::INSERT:
+            return walEntry(WalOp::INSERT, write.id, write.title, write.price, write.quantity);
+        case QueuedOp::UPDATE:
+            return walEntry(WalOp::UPDATE, write.id, write.title, write.price, write.quantity);
+        case QueuedOp::DELETE_ID:
+            break;
         }
+        return walEntry(WalOp::DELETE_ID, write.id);
+    }
 
-        in.seekg(kHeaderSize, std::ios::beg);
+    // Inserts batch[order[first..end)] together: with enough room and no
+    // migration running they go through one Table::insertBatch, anything
+    // that didn't fit takes the regular path, which may resize.
+    void insertRun(const std::vector<QueuedWrite>& batch, const std::vector<size_t>& order, const size_t first,
+                   const size_t end, std::vector<int8_t>& results)
+    {
+        std::vector<size_t> slow;
 
-        for (int32_t idx = 0; idx < capacity_; ++idx)
+        if (!old_ && count() + static_cast<int64_t>(end - first) <= table_->capacity() * 0.7)
         {
-            Record record;
-            in.read(reinterpret_cast<char*>(&record), kRecordSize);
+            std::vector<Record> records;
+            std::vector<size_t> placed;
+            std::unordered_set<int32_t> ids;
 
-            if (record.is_deleted == true)
+            for (size_t i = first; i < end; ++i)
             {
-                continue;
+                const QueuedWrite& write = batch[order[i]];
+                Table* owner = nullptr;
+                int disk_reads = 0;
+
+                if (write.id <= 0 || !ids.insert(write.id).second || findSlot(write.id, owner, disk_reads) >= 0)
+                {
+                    results[order[i]] = 0;
+                    continue;
+                }
+
+                records.push_back(makeRecord(write.id, write.title, write.price, write.quantity));
+                placed.push_back(order[i]);
             }
 
-            if constexpr (std::is_same_v<T, double>)
+            // As in changeIndexed(): indexes first, put back for whatever
+            // the table didn't take.
+            for (const Record& record : records)
             {
-                if (field_type == Fields::BY_PRICE && fabs(record.price - field) < 1e-9)
-                    result.push_back(record);
+                indexChange(nullptr, &record);
+                id_filter_.add(record.id);
             }
-            else if constexpr (std::is_same_v<T, int32_t>)
+
+            std::vector<InsertStatus> statuses;
+
+            try
             {
-                if (field_type == Fields::BY_QUANTITY && record.quantity == field)
-                    result.push_back(record);
+                statuses = table_->insertBatch(records);
             }
-            else if constexpr (std::is_same_v<T, std::string>)
+            catch (...)
             {
-                if (field_type == Fields::BY_TITLE && strcmp(record.title, field.c_str()) == 0)
-                    result.push_back(record);
+                for (const Record& record : records)
+                {
+                    undoIndexChange(nullptr, &record);
+                }
+                throw;
             }
-            else
+
+            for (size_t i = 0; i < statuses.size(); ++i)
             {
-                static_assert(sizeof(T) == 0, "Unsupported type passed to findBy()");
+                if (statuses[i] != InsertStatus::OK)
+                {
+                    undoIndexChange(nullptr, &records[i]);
+                }
+
+                if (statuses[i] == InsertStatus::FULL)
+                {
+                    slow.push_back(placed[i]);
+                    continue;
+                }
+
+                results[placed[i]] = statuses[i] == InsertStatus::OK;
+
+                if (statuses[i] == InsertStatus::OK)
+                {
+                    noteMutations();
+                }
+            }
+        }
+        else
+        {
+            for (size_t i = first; i < end; ++i)
+            {
+                slow.push_back(order[i]);
             }
         }
 
-        return result;
-    }
-
-    template <class T>
-    int32_t deleteBy(const T& field, const Fields field_type)
-    {
-        std::fstream file(kDbFile, std::ios::binary | std::ios::in | std::ios::out);
-
-        if (!file.is_open())
+        for (const size_t index : slow)
         {
-            throw std::runtime_error("File for db didn't open to delete by field");
+            const QueuedWrite& write = batch[index];
+            results[index] = insertRecord(write.id, write.title, write.price, write.quantity);
         }
+    }
 
-        int32_t count = 0;
+    // Runs on the writer thread. The batch is applied in home bucket order
+    // (a stable sort, so writes to one id keep their order) under a single
+    // exclusive lock, and it shares one WAL commit; callers are only
+    // woken once that is durable.
+    void applyBatch(std::vector<QueuedWrite>& batch)
+    {
+        std::vector<size_t> order(batch.size());
+        std::iota(order.begin(), order.end(), 0);
 
-        file.seekg(kHeaderSize, std::ios::beg);
+        std::vector<int8_t> results(batch.size(), -1);
+        std::exception_ptr error;
+        std::exception_ptr commit_error;
+        uint64_t lsn = 0;
 
-        for (int32_t idx = 0; idx < capacity_; ++idx)
+        try
         {
-            Record record;
-            file.read(reinterpret_cast<char*>(&record), kRecordSize);
+            ExclusiveLock lock(*this);
+            requireDb();
 
-            if (record.is_deleted == true)
+            std::vector<int32_t> homes(batch.size());
+
+            for (size_t i = 0; i < batch.size(); ++i)
             {
-                continue;
+                homes[i] = table_->homeOf(batch[i].id);
             }
 
-            bool flag = false;
-            if constexpr (std::is_same_v<T, double>)
+            std::stable_sort(order.begin(), order.end(), [&](const size_t a, const size_t b)
             {
-                if (field_type == Fields::BY_PRICE && fabs(record.price - field) < 1e-9)
-                    flag = true;
-            }
-            else if constexpr (std::is_same_v<T, int32_t>)
+                return homes[a] < homes[b];
+            });
+
+            for (size_t i = 0; i < order.size();)
             {
-                if (field_type == Fields::BY_QUANTITY && record.quantity == field)
-                    flag = true;
+                size_t end = i + 1;
+
+                if (batch[order[i]].op == QueuedOp::INSERT)
+                {
+                    while (end < order.size() && batch[order[end]].op == QueuedOp::INSERT)
+                    {
+                        ++end;
+                    }
+                    insertRun(batch, order, i, end, results);
+                }
+                else
+                {
+                    const QueuedWrite& write = batch[order[i]];
+
+                    results[order[i]] = write.op == QueuedOp::UPDATE
+                                            ? updateRecord(write.id, write.title, write.price, write.quantity)
+                                            : eraseById(write.id);
+                }
+
+                for (; i < end; ++i)
+                {
+                    if (results[order[i]] == 1)
+                    {
+                        lsn = logChange(walEntry(batch[order[i]]));
+                    }
+                }
             }
-            else if constexpr (std::is_same_v<T, std::string>)
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+            afterFailedChange();
+        }
+
+        try
+        {
+            finishChange(lsn);
+        }
+        catch (...)
+        {
+            commit_error = std::current_exception();
+        }
+
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            if (commit_error)
             {
-                if (field_type == Fields::BY_TITLE && strcmp(record.title, field.c_str()) == 0)
-                    flag = true;
+                batch[i].done.set_exception(commit_error);
             }
-            else
+            else if (results[i] < 0)
             {
-                static_assert(sizeof(T) == 0, "Unsupported type passed to deleteBy()");
+                batch[i].done.set_exception(error);
             }
-
-            if (flag == true)
+            else
             {
-                record.is_deleted = true;
-                file.seekp(-kRecordSize, std::ios::cur);
-                file.write(reinterpret_cast<char*>(&record), kRecordSize);
-
-                --count_;
-                ++count;
+                batch[i].done.set_value(results[i] == 1);
             }
         }
+    }
 
-        writeHeader();
-
-        return count;
+    bool enqueue(const QueuedOp op, const int32_t id, const string& title = "", const double price = 0.0,
+                 const int32_t quantity = 0)
+    {
+        return queue_.push(QueuedWrite{op, id, title, price, quantity, {}}).get();
     }
 
 public:
-    Database()
+    // scan_threads sizes the pool full scans run on; 0 means one thread
+    // per hardware thread.
+    explicit Database(const Backend backend = Backend::PREAD, const SyncMode sync = SyncMode::NONE,
+                      const HashKind hash_kind = HashKind::MURMUR, const WalOptions& wal = WalOptions(),
+                      const QueueOptions& queue = QueueOptions(), const int32_t scan_threads = 0)
+        : backend_(backend), sync_(sync), hash_kind_(hash_kind),
+          table_(makeTable(kDbFile)),
+          wal_options_(wal),
+          wal_(kWalFile, std::chrono::microseconds(wal.window_us), wal.max_group),
+          journal_(kJournalFile),
+          queue_(queue.max_batch, std::chrono::microseconds(queue.window_us)),
+          scan_pool_(scan_threads > 0 ? scan_threads : std::thread::hardware_concurrency()),
+          price_index_(kPriceIndexFile),
+          title_index_(kTitleIndexFile),
+          prefix_index_(kPrefixIndexFile),
+          quantity_index_(kQuantityIndexFile)
     {
-        std::ifstream in(kDbFile, std::ios::binary);
+        upgradeLegacyFile(kDbFile);
+        upgradeLegacyFile(kResizeFile);
 
-        if (in.is_open())
+        if (wal_options_.enabled)
         {
-            Header header;
+            journal_.open();
+
+            const int64_t restored = journal_.restore();
 
-            in.read(reinterpret_cast<char*>(&header), kHeaderSize);
-            capacity_ = header.capacity;
-            count_ = header.count;
+            if (restored > 0)
+            {
+                cout << "Restored " << restored << " pages from the journal" << endl;
+            }
+        }
+
+        if (std::filesystem::exists(kResizeFile) && std::filesystem::exists(kDbFile))
+        {
+            // Interrupted resize: both files are consistent tables, so
+            // simply resume moving records from the old one.
+            old_ = std::move(table_);
+            old_->open();
+            old_->setDraining(true);
+
+            table_ = makeTable(kResizeFile);
+            table_->open();
+        }
+        else if (std::filesystem::exists(kResizeFile))
+        {
+            std::filesystem::rename(kResizeFile, kDbFile);
+            table_->open();
+        }
+        else if (std::filesystem::exists(kDbFile))
+        {
+            table_->open();
         }
         else
         {
-            createNew(100);
+            createNew(kInitialCapacity);
+        }
+
+        openIndexes();
+
+        if (wal_options_.enabled)
+        {
+            wal_.open();
+            replayWal();
+        }
+
+        if (queue.enabled)
+        {
+            queue_.start([this](std::vector<QueuedWrite>& batch) { applyBatch(batch); });
         }
     }
 
+    ~Database()
+    {
+        queue_.stop();
+        checkpoint();
+    }
+
+    Database(const Database&) = delete;
+    Database& operator=(const Database&) = delete;
+
     bool create()
     {
+        ExclusiveLock lock(*this);
+
         if (std::filesystem::exists(kDbFile))
         {
             return false;
         }
-        createNew(100);
+        createNew(kInitialCapacity);
+        openIndexes();
         return true;
     }
 
     void drop()
     {
+        ExclusiveLock lock(*this);
+
+        abortMigration();
+        table_->close();
+        price_index_.close();
+        title_index_.close();
+        prefix_index_.close();
+        trigram_index_.rebuild({});
+        quantity_index_.close();
+        id_filter_.clear();
+
         if (std::filesystem::exists(kDbFile))
         {
             std::filesystem::remove(kDbFile);
         }
-        capacity_ = 0;
-        count_ = 0;
+        std::filesystem::remove(kPriceIndexFile);
+        std::filesystem::remove(kTitleIndexFile);
+        std::filesystem::remove(kPrefixIndexFile);
+        std::filesystem::remove(kQuantityIndexFile);
+
+        if (wal_.isOpen())
+        {
+            wal_.reset();
+        }
     }
 
-    bool insert(int32_t id, string title, double price, int32_t quantity)
+    bool insert(const int32_t id, const string& title, const double price, const int32_t quantity)
     {
         if (id <= 0)
         {
             return false;
         }
 
-        const int32_t ind = hash(id);
-
-        if (count_ > capacity_ * 0.7)
+        if (queue_.running())
         {
-            resize();
+            return enqueue(QueuedOp::INSERT, id, title, price, quantity);
         }
 
-        std::fstream file(kDbFile, std::ios::binary | std::ios::in | std::ios::out);
-
-        if (!file.is_open())
+        return pointChange(id, walEntry(WalOp::INSERT, id, title, price, quantity),
+                           [&](const bool exclusive, std::vector<Record>* before) -> std::optional<bool>
         {
-            throw std::runtime_error("File for db didn't open to insert");
-        }
+            if (exclusive)
+            {
+                return insertRecord(id, title, price, quantity);
+            }
 
-        for (int32_t idx = 0; idx < capacity_; ++idx)
-        {
-            Record record;
-            file.seekg(kHeaderSize + ((ind + idx) % capacity_) * kRecordSize, std::ios::beg);
-            file.read(reinterpret_cast<char*>(&record), kRecordSize);
+            if (count() > table_->capacity() * 0.7)
+            {
+                return std::nullopt;
+            }
 
-            if (!record.is_deleted && record.id == id)
+            Table* owner = nullptr;
+            int disk_reads = 0;
+
+            if (findSlot(id, owner, disk_reads) >= 0)
             {
                 return false;
             }
 
-            if (record.is_deleted)
-            {
-                record.is_deleted = false;
-                record.id = id;
+            const Record record = makeRecord(id, title, price, quantity);
+            InsertStatus status = InsertStatus::OK;
 
-                std::strncpy(record.title, title.c_str(), sizeof(record.title));
-                record.title[sizeof(record.title) - 1] = '\0';
+            changeIndexed(nullptr, &record, [&]
+            {
+                status = table_->insert(record, before);
+                return status == InsertStatus::OK;
+            });
 
-                record.price = price;
-                record.quantity = quantity;
+            if (status == InsertStatus::FULL)
+            {
+                return std::nullopt;
+            }
+            if (status != InsertStatus::OK)
+            {
+                return false;
+            }
 
-                file.seekp(kHeaderSize + ((ind + idx) % capacity_) * kRecordSize, std::ios::beg);
-                file.write(reinterpret_cast<char*>(&record), kRecordSize);
+            noteMutations();
+            return true;
+        });
+    }
 
-                ++count_;
-                writeHeader();
+    std::optional<Record> findById(const int32_t id, int& disk_reads) const
+    {
+        std::optional<Record> result;
 
-                return true;
-            }
+        if (optimisticFind(id, disk_reads, result))
+        {
+            return result;
         }
 
-        resize();
+        disk_reads = 0;
+
+        std::shared_lock<RwMutex> lock(mutex_);
+        requireDb();
+
+        StripeLocks stripes(stripes_, true);
+        lockSpan(*table_, id, stripes);
+
+        Table* owner = nullptr;
+        Record record;
 
-        bool res = insert(id, title, price, quantity);
+        if (findSlot(id, owner, disk_reads, &record) < 0)
+        {
+            return std::nullopt;
+        }
 
-        return res;
+        return record;
     }
 
-    Record* findById(const int32_t id, int& disk_reads) const
+    // Served from the title index: only the records it points at are
+    // read, and those whose title doesn't match (a hash collision, or a
+    // concurrent update) are dropped.
+    vector<Record> findByTitle(const string& title) const
     {
-        static Record res;
-        disk_reads = 0;
+        vector<int32_t> ids;
+        {
+            std::shared_lock<RwMutex> lock(mutex_);
+            requireDb();
+
+            ids = title_index_.find(title);
+        }
 
-        std::ifstream in(kDbFile, std::ios::binary);
+        vector<Record> result;
 
-        if (!in.is_open())
+        for (const int32_t id : ids)
         {
-            throw std::runtime_error("File for db didn't open to findById");
+            int disk_reads = 0;
+            const std::optional<Record> record = findById(id, disk_reads);
+
+            if (record && matches(*record, title, Fields::BY_TITLE))
+            {
+                result.push_back(*record);
+            }
         }
 
-        const int32_t ind = hash(id);
+        return result;
+    }
 
-        for (int32_t idx = 0; idx < capacity_; ++idx)
+    // Records whose title starts with prefix, ordered by title, then id;
+    // at most limit of them if limit isn't 0. The prefix index gives the
+    // matching titles, the title index their records.
+    vector<Record> findByTitlePrefix(const string& prefix, const size_t limit) const
+    {
+        vector<string> titles;
         {
-            Record record;
-            in.seekg(kHeaderSize + ((ind + idx) % capacity_) * kRecordSize, std::ios::beg);
-            in.read(reinterpret_cast<char*>(&record), kRecordSize);
-            ++disk_reads;
+            std::shared_lock<RwMutex> lock(mutex_);
+            requireDb();
 
-            if (record.is_deleted == true && record.id == 0)
+            for (auto& match : prefix_index_.complete(prefix, limit))
             {
-                return nullptr;
+                titles.push_back(std::move(match.first));
             }
+        }
+
+        return recordsWithTitles(titles, limit);
+    }
+
+    // Records whose title contains text, ordered by title, then id; at
+    // most limit of them if limit isn't 0.
+    vector<Record> findByTitleSubstring(const string& text, const size_t limit) const
+    {
+        vector<string> titles;
+        {
+            std::shared_lock<RwMutex> lock(mutex_);
+            requireDb();
 
-            if (!record.is_deleted && record.id == id)
+            // Longer text can't be in a title.
+            if (text.size() < kTitleSize)
             {
-                res = record;
-                return &res;
+                titles = trigram_index_.containing(text);
             }
         }
 
-        return nullptr;
+        return recordsWithTitles(titles, limit);
     }
 
-    vector<Record> findByTitle(const string& title) const
+    // Records whose title is within max_edits single-character edits of
+    // title, closest first, then by title and id; at most limit of them
+    // if limit isn't 0.
+    vector<Record> findByTitleFuzzy(const string& title, const int32_t max_edits, const size_t limit) const
     {
-        return findBy(title, Fields::BY_TITLE);
+        vector<string> titles;
+        {
+            std::shared_lock<RwMutex> lock(mutex_);
+            requireDb();
+
+            if (max_edits >= 0 && title.size() < kTitleSize + max_edits)
+            {
+                for (auto& match : trigram_index_.similar(title, max_edits))
+                {
+                    titles.push_back(std::move(match.first));
+                }
+            }
+        }
+
+        return recordsWithTitles(titles, limit);
     }
 
+    // Served from the quantity index, in id order.
     vector<Record> findByQuantity(const int32_t quantity) const
     {
-        return findBy(quantity, Fields::BY_QUANTITY);
+        vector<int32_t> ids;
+        {
+            std::shared_lock<RwMutex> lock(mutex_);
+            requireDb();
+
+            ids = idsOf(quantity_index_.matching(quantity, quantity));
+        }
+
+        vector<Record> result;
+        result.reserve(ids.size());
+
+        for (const int32_t id : ids)
+        {
+            int disk_reads = 0;
+            const std::optional<Record> record = findById(id, disk_reads);
+
+            if (record && record->quantity == quantity)
+            {
+                result.push_back(*record);
+            }
+        }
+
+        return result;
+    }
+
+    // Number of records with min <= quantity <= max and, unless the
+    // price bounds are left infinite, price_min <= price <= price_max.
+    // Answered from the indexes alone: the quantity bitmaps, ANDed with
+    // a bitmap of the price index's ids when the price is bounded.
+    int64_t countByQuantity(const int32_t min, const int32_t max,
+                            const double price_min = -std::numeric_limits<double>::infinity(),
+                            const double price_max = std::numeric_limits<double>::infinity()) const
+    {
+        std::shared_lock<RwMutex> lock(mutex_);
+        requireDb();
+
+        if (price_min == -std::numeric_limits<double>::infinity() &&
+            price_max == std::numeric_limits<double>::infinity())
+        {
+            return quantity_index_.count(min, max);
+        }
+
+        RoaringBitmap priced;
+        priced.addAll(price_index_.range(price_min, price_max, 0));
+
+        RoaringBitmap matching = quantity_index_.matching(min, max);
+        matching &= priced;
+
+        return matching.cardinality();
     }
 
     vector<Record> findByPrice(const double price) const
@@ -369,137 +2141,153 @@ public:
         return findBy(price, Fields::BY_PRICE);
     }
 
-    bool deleteById(const int32_t id)
+    // Records with min <= price <= max, cheapest first (ties by id), at
+    // most limit of them if limit isn't 0. Served from the price index;
+    // the records themselves are then looked up by id.
+    vector<Record> findByPriceRange(const double min, const double max, const size_t limit) const
     {
-        std::fstream file(kDbFile, std::ios::binary | std::ios::in | std::ios::out);
-
-        if (!file.is_open())
+        vector<int32_t> ids;
         {
-            throw std::runtime_error("Couldn't open database to delete by id");
-        }
+            std::shared_lock<RwMutex> lock(mutex_);
+            requireDb();
 
-        const int32_t hash_id = hash(id);
+            ids = price_index_.range(min, max, limit);
+        }
 
-        file.seekg(kHeaderSize, std::ios::beg);
+        vector<Record> result;
+        result.reserve(ids.size());
 
-        for (int32_t idx = 0; idx < capacity_; ++idx)
+        for (const int32_t id : ids)
         {
-            Record record;
-            file.seekg(kHeaderSize + ((hash_id + idx) % capacity_) * kRecordSize, std::ios::beg);
-            file.read(reinterpret_cast<char*>(&record), kRecordSize);
+            int disk_reads = 0;
+            const std::optional<Record> record = findById(id, disk_reads);
 
-            if (record.is_deleted && record.id == 0)
+            // The record may have changed since the index was read.
+            if (record && record->price >= min && record->price <= max)
             {
-                return false;
+                result.push_back(*record);
             }
+        }
 
-            if (!record.is_deleted && record.id == id)
-            {
-                record.is_deleted = true;
+        std::sort(result.begin(), result.end(), [](const Record& a, const Record& b)
+        {
+            return PriceKey{a.price, a.id} < PriceKey{b.price, b.id};
+        });
 
-                file.seekp(kHeaderSize + ((hash_id + idx) % capacity_) * kRecordSize, std::ios::beg);
-                file.write(reinterpret_cast<char*>(&record), kRecordSize);
+        return result;
+    }
 
-                --count_;
-                writeHeader();
-                return true;
-            }
+    bool deleteById(const int32_t id)
+    {
+        if (queue_.running())
+        {
+            return enqueue(QueuedOp::DELETE_ID, id);
         }
 
-        return false;
+        return pointChange(id, walEntry(WalOp::DELETE_ID, id), [&](bool, std::vector<Record>* before) -> std::optional<bool>
+        {
+            return eraseById(id, before);
+        });
     }
 
     int32_t deleteByTitle(const std::string& title)
     {
-        return deleteBy(title, Fields::BY_TITLE);
+        return deleteLogged(title, Fields::BY_TITLE, walEntry(WalOp::DELETE_TITLE, 0, title));
     }
 
     int32_t deleteByPrice(const double price)
     {
-        return deleteBy(price, Fields::BY_PRICE);
+        return deleteLogged(price, Fields::BY_PRICE, walEntry(WalOp::DELETE_PRICE, 0, "", price));
     }
 
     int32_t deleteByQuantity(const int32_t quantity)
     {
-        return deleteBy(quantity, Fields::BY_QUANTITY);
+        return deleteLogged(quantity, Fields::BY_QUANTITY, walEntry(WalOp::DELETE_QUANTITY, 0, "", 0.0, quantity));
     }
 
     vector<Record> getAll() const
     {
-        vector<Record> list;
-
-        std::ifstream in(kDbFile, std::ios::binary);
+        return scanSnapshot([](const Record&) { return true; },
+                            [](const Table* table, Table::BucketStream& stream, auto f)
+                            {
+                                table->forEachMatch(stream, [](const Record*) { return kSlotMask; }, f);
+                            });
+    }
 
-        if (!in.is_open())
+    bool update(const int32_t id, const string& new_title, const double new_price, const int32_t new_quantity)
+    {
+        if (queue_.running())
         {
-            throw std::runtime_error("File for db didn't open to getAll");
+            return enqueue(QueuedOp::UPDATE, id, new_title, new_price, new_quantity);
         }
 
-        in.seekg(kHeaderSize, std::ios::beg);
-
-        for (int32_t idx = 0; idx < capacity_; ++idx)
+        return pointChange(id, walEntry(WalOp::UPDATE, id, new_title, new_price, new_quantity),
+                           [&](bool, std::vector<Record>* before) -> std::optional<bool>
         {
-            Record record;
-            in.read(reinterpret_cast<char*>(&record), kRecordSize);
-
-            if (record.is_deleted == false)
-            {
-                list.push_back(record);
-            }
-        }
-
-        return list;
+            return updateRecord(id, new_title, new_price, new_quantity, before);
+        });
     }
 
-    bool update(const int32_t id, const string& new_title, const double new_price, const int32_t new_quantity)
+    // Probe distances are counted in buckets past the home bucket and, for
+    // the *_slots fields, in slots from the start of the home bucket.
+    DbStats stats() const
     {
-        std::fstream file(kDbFile, std::ios::binary | std::ios::in | std::ios::out);
-        if (!file.is_open())
-        {
-            return false;
-        }
+        std::shared_lock<RwMutex> lock(mutex_);
+        requireDb();
 
-        const int32_t ind = hash(id);
+        StripeLocks stripes(stripes_, true);
+        stripes.lockAll();
 
-        for (int32_t idx = 0; idx < capacity_; ++idx)
+        DbStats result{count(), table_->capacity(), old_ != nullptr, 0, 0.0, 0, 0.0, {}};
+        int64_t live = 0;
+        int64_t total = 0;
+        int64_t total_slots = 0;
+
+        for (const Table* table : tables())
         {
-            int32_t offset = kHeaderSize + ((ind + idx) % capacity_) * kRecordSize;
+            const ProbeStats probe = table->probeStats();
 
-            file.seekg(offset, std::ios::beg);
-            Record record;
-            file.read(reinterpret_cast<char*>(&record), kRecordSize);
+            live += probe.live;
+            total += probe.total_distance;
+            total_slots += probe.total_slots;
+            result.max_probe = std::max(result.max_probe, probe.max_distance);
+            result.max_probe_slots = std::max(result.max_probe_slots, probe.max_slots);
 
-            if (!record.is_deleted && record.id == id)
+            if (result.probe_histogram.size() < probe.histogram.size())
             {
-                std::strncpy(record.title, new_title.c_str(), sizeof(record.title));
-                record.title[sizeof(record.title) - 1] = '\0';
-                record.price = new_price;
-                record.quantity = new_quantity;
-
-                file.seekp(offset, std::ios::beg);
-                file.write(reinterpret_cast<char*>(&record), kRecordSize);
-
-                return true;
+                result.probe_histogram.resize(probe.histogram.size());
             }
-
-            if (record.is_deleted && record.id == 0)
+            for (size_t distance = 0; distance < probe.histogram.size(); ++distance)
             {
-                return false;
+                result.probe_histogram[distance] += probe.histogram[distance];
             }
         }
 
-        return false;
+        result.mean_probe = live == 0 ? 0.0 : static_cast<double>(total) / live;
+        result.mean_probe_slots = live == 0 ? 0.0 : static_cast<double>(total_slots) / live;
+        result.wal = wal_.stats();
+        result.queue = queue_.stats();
+
+        return result;
     }
 
     void clear()
     {
-        createNew(100);
+        ExclusiveLock lock(*this);
+
+        createNew(kInitialCapacity);
+        openIndexes(true);
+        checkpoint();
     }
 
-    void backup() const
+    void backup()
     {
+        ExclusiveLock lock(*this);
+
         try
         {
+            finishMigration();
+            checkpoint();
             std::filesystem::copy_file(kDbFile, kBackupFile,
                                        std::filesystem::copy_options::overwrite_existing);
         }
@@ -511,6 +2299,11 @@ public:
 
     void restore()
     {
+        ExclusiveLock lock(*this);
+
+        abortMigration();
+        table_->close();
+
         bool res = std::filesystem::copy_file(kBackupFile, kDbFile,
                                               std::filesystem::copy_options::overwrite_existing);
 
@@ -519,24 +2312,19 @@ public:
             std::cerr << "Couldn't make restore" << std::endl;
         }
 
-        std::ifstream in(kDbFile, std::ios::binary);
-
-        Header header;
-
-        in.read(reinterpret_cast<char*>(&header), kHeaderSize);
-
-        capacity_ = header.capacity;
-        count_ = header.count;
+        upgradeLegacyFile(kDbFile);
+        table_->open();
+        openIndexes(true);
+        checkpoint();
     }
 
+    // Rows are written as the buckets stream past, so the records are never
+    // all in memory. Point writers wait on their stripes until the export
+    // is done, which keeps the file one consistent state; lookups don't.
     void exportCSV() const
     {
-        std::ifstream in(kDbFile, std::ios::binary);
-
-        if (!in)
-        {
-            throw std::runtime_error("Couldn't open database file in exportCSV");
-        }
+        std::shared_lock<RwMutex> lock(mutex_);
+        requireDb();
 
         std::ofstream out(kCSVFile);
 
@@ -545,23 +2333,19 @@ public:
             throw std::runtime_error("Couldn't open .csv file in exportCSV");
         }
 
-        out << "id,title,price,quantity\n";
+        StripeLocks stripes(stripes_, true);
+        stripes.lockAll();
 
-        in.seekg(kHeaderSize, std::ios::beg);
+        out << "id,title,price,quantity\n";
 
-        for (int32_t idx = 0; idx < capacity_; ++idx)
+        for (const Table* table : tables())
         {
-            Record record;
-            in.read(reinterpret_cast<char*>(&record), kRecordSize);
-
-            if (record.is_deleted)
+            table->forEachLive([&](int32_t, const Record& record)
             {
-                continue;
-            }
-
-            std::string title(record.title);
+                std::string title(record.title);
 
-            out << record.id << "," << '"' << title << '"' << "," << record.price << "," << record.quantity << "\n";
+                out << record.id << "," << '"' << title << '"' << "," << record.price << "," << record.quantity << "\n";
+            });
         }
     }
 };
@@ -0,0 +1,118 @@
+#ifndef ID_FILTER_H
+#define ID_FILTER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include "RoaringBitmap.h"
+#include "Table.h"
+
+using namespace std;
+
+// Counters per table slot: at the 0.7 load the table resizes at, that's
+// over 11 per id, for about 1% false positives with 5 counters per id.
+constexpr int32_t kFilterCountersPerSlot = 8;
+constexpr int32_t kFilterBlockCounters = 64;
+constexpr int32_t kFilterProbes = 5;
+
+// Counting Bloom filter over the live ids, so that lookups of ids that
+// don't exist can be answered without touching the table. Blocked: all
+// counters of an id sit in one 64-byte block, i.e. one cache line. The
+// counters are atomic, since inserts and deletes on different stripes
+// update them concurrently while lock-free lookups read them; a counter
+// that reaches 255 stays there, which can only cost false positives.
+class IdFilter
+{
+private:
+    int64_t blocks_ = 0;
+    std::unique_ptr<std::atomic<uint8_t>[]> counters_;
+
+    // Calls f on each of the id's counters; positions come from the low
+    // 30 bits of the hash, the block from the high 32.
+    template <class F>
+    void forEachCounter(const int32_t id, F f) const
+    {
+        const uint64_t h = murmurMix(static_cast<uint32_t>(id));
+        std::atomic<uint8_t>* block =
+            counters_.get() + static_cast<int64_t>(((h >> 32) * static_cast<uint64_t>(blocks_)) >> 32) *
+                              kFilterBlockCounters;
+
+        for (int32_t i = 0; i < kFilterProbes; ++i)
+        {
+            f(block[(h >> (6 * i)) & (kFilterBlockCounters - 1)]);
+        }
+    }
+
+public:
+    // Resets the filter to the ids in ids, sized for a table of capacity
+    // slots. Nothing may use the filter meanwhile.
+    void rebuild(const int64_t capacity, const RoaringBitmap& ids)
+    {
+        blocks_ = std::max<int64_t>(1, capacity * kFilterCountersPerSlot / kFilterBlockCounters);
+        counters_.reset(new std::atomic<uint8_t>[blocks_ * kFilterBlockCounters]());
+
+        ids.forEach([&](const uint32_t id) { add(static_cast<int32_t>(id)); });
+    }
+
+    // Drops the filter; until the next rebuild every id may be present.
+    void clear()
+    {
+        blocks_ = 0;
+        counters_.reset();
+    }
+
+    void add(const int32_t id)
+    {
+        if (blocks_ == 0)
+        {
+            return;
+        }
+
+        forEachCounter(id, [](std::atomic<uint8_t>& counter)
+        {
+            uint8_t value = counter.load(std::memory_order_relaxed);
+
+            while (value != UINT8_MAX && !counter.compare_exchange_weak(value, value + 1))
+            {
+            }
+        });
+    }
+
+    void remove(const int32_t id)
+    {
+        if (blocks_ == 0)
+        {
+            return;
+        }
+
+        forEachCounter(id, [](std::atomic<uint8_t>& counter)
+        {
+            uint8_t value = counter.load(std::memory_order_relaxed);
+
+            while (value != UINT8_MAX && value != 0 && !counter.compare_exchange_weak(value, value - 1))
+            {
+            }
+        });
+    }
+
+    // False only if id is certainly not live.
+    bool mayContain(const int32_t id) const
+    {
+        if (blocks_ == 0)
+        {
+            return true;
+        }
+
+        bool result = true;
+
+        forEachCounter(id, [&](const std::atomic<uint8_t>& counter)
+        {
+            result = result && counter.load() != 0;
+        });
+
+        return result;
+    }
+};
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef PAGE_JOURNAL_H
+#define PAGE_JOURNAL_H
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Table.h"
+#include "Wal.h"
+
+using namespace std;
+
+// One saved page: the bucket's contents as of the last checkpoint.
+struct JournalImage
+{
+    uint32_t crc;
+    int32_t bucket;
+    char path[56];
+    Bucket page;
+};
+
+// Before-images of table pages. The first time a bucket changes after a
+// checkpoint, its old page is appended here and made durable before the
+// table file is touched (Table calls save() through its before-write
+// hook). After a crash, restore() puts every saved page back, which
+// returns each table file to exactly its state at the checkpoint however
+// many of the page writes since then reached the disk; the logical WAL is
+// then replayed from there. reset() drops the images once the tables
+// themselves are on disk again.
+class PageJournal
+{
+private:
+    string path_;
+    int fd_ = -1;
+    off_t size_ = 0;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<JournalImage> buffer_;
+    uint64_t appended_ = 0;
+    uint64_t durable_ = 0;
+    bool flushing_ = false;
+
+    static uint32_t imageCrc(const JournalImage& image)
+    {
+        return crc32(reinterpret_cast<const char*>(&image) + sizeof(image.crc), sizeof(image) - sizeof(image.crc));
+    }
+
+    static void writeFully(const int fd, const void* data, const size_t len, const off_t offset)
+    {
+        const char* ptr = static_cast<const char*>(data);
+        size_t done = 0;
+
+        while (done < len)
+        {
+            const ssize_t n = ::pwrite(fd, ptr + done, len - done, offset + done);
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                throw std::runtime_error("Couldn't write page image");
+            }
+            done += n;
+        }
+    }
+
+public:
+    explicit PageJournal(string path) : path_(std::move(path))
+    {
+    }
+
+    ~PageJournal()
+    {
+        close();
+    }
+
+    PageJournal(const PageJournal&) = delete;
+    PageJournal& operator=(const PageJournal&) = delete;
+
+    bool isOpen() const
+    {
+        return fd_ >= 0;
+    }
+
+    void open()
+    {
+        close();
+
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+
+        if (fd_ < 0)
+        {
+            throw std::runtime_error("Journal file didn't open");
+        }
+
+        size_ = ::lseek(fd_, 0, SEEK_END);
+    }
+
+    void close()
+    {
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    // Appends the current pages of buckets of table and waits until they
+    // are on disk. The caller holds the buckets, so nobody changes them
+    // while they are read. Concurrent savers share one write and one
+    // fdatasync the way WAL commits do.
+    void save(const Table& table, const std::vector<int32_t>& buckets)
+    {
+        std::vector<JournalImage> images(buckets.size());
+
+        for (size_t i = 0; i < buckets.size(); ++i)
+        {
+            JournalImage& image = images[i];
+
+            image.bucket = buckets[i];
+            std::strncpy(image.path, table.path().c_str(), sizeof(image.path) - 1);
+            table.readBuckets(buckets[i], 1, &image.page);
+            image.crc = imageCrc(image);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        buffer_.insert(buffer_.end(), images.begin(), images.end());
+        appended_ += images.size();
+        const uint64_t mine = appended_;
+
+        while (durable_ < mine)
+        {
+            if (flushing_)
+            {
+                cv_.wait(lock);
+                continue;
+            }
+
+            flushing_ = true;
+
+            std::vector<JournalImage> batch;
+            batch.swap(buffer_);
+            const uint64_t upto = appended_;
+            const off_t offset = size_;
+            const size_t len = batch.size() * sizeof(JournalImage);
+
+            lock.unlock();
+
+            try
+            {
+                writeFully(fd_, batch.data(), len, offset);
+
+                if (::fdatasync(fd_) != 0)
+                {
+                    throw std::runtime_error("Couldn't fdatasync journal");
+                }
+            }
+            catch (...)
+            {
+                // The pages behind the batch weren't written, so it is
+                // simply written again, whole, by the next save.
+                lock.lock();
+                buffer_.insert(buffer_.begin(), batch.begin(), batch.end());
+                flushing_ = false;
+                cv_.notify_all();
+                throw;
+            }
+
+            lock.lock();
+
+            size_ = offset + len;
+            durable_ = upto;
+            flushing_ = false;
+
+            cv_.notify_all();
+        }
+    }
+
+    // Writes every intact image back into its table file (bucket b is page
+    // b + 1, after the header), then syncs those files; returns how many
+    // were restored. Only the last save() can be torn, and its pages
+    // weren't written yet, so reading stops there. Images of files that no
+    // longer exist are skipped.
+    int64_t restore() const
+    {
+        JournalImage image;
+        std::map<string, int> files;
+        int64_t applied = 0;
+
+        auto closeFiles = [&]
+        {
+            for (const auto& [path, fd] : files)
+            {
+                ::close(fd);
+            }
+        };
+
+        try
+        {
+            for (off_t offset = 0; ::pread(fd_, &image, sizeof(image), offset) == sizeof(image);
+                 offset += sizeof(image))
+            {
+                if (image.crc != imageCrc(image))
+                {
+                    break;
+                }
+
+                image.path[sizeof(image.path) - 1] = '\0';
+                auto it = files.find(image.path);
+
+                if (it == files.end())
+                {
+                    if (!std::filesystem::exists(image.path))
+                    {
+                        continue;
+                    }
+
+                    const int fd = ::open(image.path, O_RDWR);
+
+                    if (fd < 0)
+                    {
+                        throw std::runtime_error("Couldn't open db file to restore pages");
+                    }
+                    it = files.emplace(image.path, fd).first;
+                }
+
+                writeFully(it->second, &image.page, sizeof(image.page),
+                           static_cast<off_t>(image.bucket + 1) * kPageSize);
+                ++applied;
+            }
+
+            for (const auto& [path, fd] : files)
+            {
+                if (::fdatasync(fd) != 0)
+                {
+                    throw std::runtime_error("Couldn't fdatasync restored pages");
+                }
+            }
+        }
+        catch (...)
+        {
+            closeFiles();
+            throw;
+        }
+
+        closeFiles();
+        return applied;
+    }
+
+    // Forgets every image; only valid once the tables they came from are
+    // on disk (Table::flush) or replaced altogether.
+    void reset()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        cv_.wait(lock, [&] { return !flushing_; });
+
+        buffer_.clear();
+        durable_ = appended_;
+
+        if (fd_ < 0)
+        {
+            return;
+        }
+
+        if (::ftruncate(fd_, 0) != 0 || ::fdatasync(fd_) != 0)
+        {
+            throw std::runtime_error("Couldn't truncate journal");
+        }
+        size_ = 0;
+    }
+};
+
+#endif
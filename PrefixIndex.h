@@ -0,0 +1,447 @@
+#ifndef PREFIX_INDEX_H
+#define PREFIX_INDEX_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+constexpr uint32_t kPrefixIndexMagic = 0x58444952;
+
+struct PrefixIndexHeader
+{
+    uint32_t magic;
+    int32_t clean;
+    int64_t entries;
+    int64_t titles;
+    int64_t bytes;
+};
+
+// Radix trie node: edge is the label of the edge leading here, count the
+// number of records whose title ends at this node. Children are sorted by
+// the first byte of their edge, and no two share it.
+struct PrefixNode
+{
+    string edge;
+    int32_t count = 0;
+    std::vector<std::unique_ptr<PrefixNode>> children;
+};
+
+// Sorted index of the distinct titles, for prefix search. The trie is
+// compressed (chains of single children are merged into one edge) and
+// kept in memory; flush() writes the titles out in order, front-coded:
+// per title the length of the prefix shared with the previous one, the
+// rest of it and its record count. The header is marked dirty before
+// the first change after that, as with the other indexes.
+class PrefixIndex
+{
+private:
+    string path_;
+    int fd_ = -1;
+    PrefixIndexHeader header_{};
+    PrefixNode root_;
+    mutable std::mutex mutex_;
+
+    void readAt(const off_t offset, void* buf, const size_t len) const
+    {
+        char* ptr = static_cast<char*>(buf);
+        size_t done = 0;
+
+        while (done < len)
+        {
+            const ssize_t n = ::pread(fd_, ptr + done, len - done, offset + done);
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                throw std::runtime_error("Couldn't read prefix index");
+            }
+            done += n;
+        }
+    }
+
+    void writeAt(const off_t offset, const void* buf, const size_t len) const
+    {
+        const char* ptr = static_cast<const char*>(buf);
+        size_t done = 0;
+
+        while (done < len)
+        {
+            const ssize_t n = ::pwrite(fd_, ptr + done, len - done, offset + done);
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                throw std::runtime_error("Couldn't write prefix index");
+            }
+            done += n;
+        }
+    }
+
+    void writeHeader() const
+    {
+        writeAt(0, &header_, sizeof(header_));
+    }
+
+    void markDirty()
+    {
+        if (header_.clean != 0)
+        {
+            header_.clean = 0;
+            writeHeader();
+            ::fdatasync(fd_);
+        }
+    }
+
+    // Child of node whose edge starts with c, or where it would go;
+    // bytes compare unsigned, like std::string does.
+    template <class Node>
+    static auto childAt(Node& node, const char c)
+    {
+        return std::lower_bound(node.children.begin(), node.children.end(), c,
+                                [](const std::unique_ptr<PrefixNode>& child, const char value)
+                                {
+                                    return static_cast<uint8_t>(child->edge[0]) < static_cast<uint8_t>(value);
+                                });
+    }
+
+    // Adds n records with this title, splitting an edge where the title
+    // leaves it.
+    void add(string_view title, const int32_t n)
+    {
+        PrefixNode* node = &root_;
+
+        while (!title.empty())
+        {
+            const auto it = childAt(*node, title[0]);
+
+            if (it == node->children.end() || (*it)->edge[0] != title[0])
+            {
+                auto leaf = std::make_unique<PrefixNode>();
+                leaf->edge = string(title);
+
+                node = node->children.insert(it, std::move(leaf))->get();
+                break;
+            }
+
+            const string& edge = (*it)->edge;
+            const size_t common = std::mismatch(edge.begin(), edge.end(), title.begin(), title.end()).first -
+                                  edge.begin();
+
+            if (common < edge.size())
+            {
+                auto mid = std::make_unique<PrefixNode>();
+                mid->edge = edge.substr(0, common);
+                (*it)->edge.erase(0, common);
+                mid->children.push_back(std::move(*it));
+                *it = std::move(mid);
+            }
+
+            node = it->get();
+            title.remove_prefix(common);
+        }
+
+        node->count += n;
+        header_.entries += n;
+    }
+
+    // Removes one record with the rest of the title below node and drops
+    // or merges the nodes it leaves without a purpose. Returns false if
+    // there is no such title.
+    bool removeBelow(PrefixNode& node, string_view rest)
+    {
+        if (rest.empty())
+        {
+            if (node.count == 0)
+            {
+                return false;
+            }
+            --node.count;
+            return true;
+        }
+
+        const auto it = childAt(node, rest[0]);
+
+        if (it == node.children.end() || rest.compare(0, (*it)->edge.size(), (*it)->edge) != 0)
+        {
+            return false;
+        }
+
+        PrefixNode& child = **it;
+
+        if (!removeBelow(child, rest.substr(child.edge.size())))
+        {
+            return false;
+        }
+
+        if (child.count == 0 && child.children.empty())
+        {
+            node.children.erase(it);
+        }
+        else if (child.count == 0 && child.children.size() == 1)
+        {
+            std::unique_ptr<PrefixNode> only = std::move(child.children[0]);
+            only->edge.insert(0, child.edge);
+            *it = std::move(only);
+        }
+
+        return true;
+    }
+
+    // Every title below node in order, path being the title of node
+    // itself; stops once limit titles are collected (0 means no limit).
+    static void collect(const PrefixNode& node, string& path, const size_t limit,
+                        std::vector<std::pair<string, int32_t>>& out)
+    {
+        if (node.count > 0)
+        {
+            out.emplace_back(path, node.count);
+        }
+
+        for (const auto& child : node.children)
+        {
+            if (limit != 0 && out.size() >= limit)
+            {
+                return;
+            }
+
+            path += child->edge;
+            collect(*child, path, limit, out);
+            path.resize(path.size() - child->edge.size());
+        }
+    }
+
+    void reset()
+    {
+        root_.count = 0;
+        root_.children.clear();
+        header_.entries = 0;
+        header_.titles = 0;
+        header_.bytes = 0;
+    }
+
+public:
+    explicit PrefixIndex(string path) : path_(std::move(path))
+    {
+    }
+
+    ~PrefixIndex()
+    {
+        close();
+    }
+
+    PrefixIndex(const PrefixIndex&) = delete;
+    PrefixIndex& operator=(const PrefixIndex&) = delete;
+
+    // Returns false if the file is new, foreign or wasn't flushed after
+    // its last change; it then has to be rebuilt before use.
+    bool open()
+    {
+        close();
+
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+
+        if (fd_ < 0)
+        {
+            throw std::runtime_error("Prefix index file didn't open");
+        }
+
+        if (::pread(fd_, &header_, sizeof(header_), 0) != static_cast<ssize_t>(sizeof(header_)) ||
+            header_.magic != kPrefixIndexMagic || header_.clean == 0)
+        {
+            header_ = PrefixIndexHeader{kPrefixIndexMagic, 0, 0, 0, 0};
+            return false;
+        }
+
+        std::vector<char> data(header_.bytes);
+        readAt(sizeof(header_), data.data(), data.size());
+
+        const int64_t entries = header_.entries;
+        header_.entries = 0;
+
+        string title;
+        size_t pos = 0;
+
+        for (int64_t i = 0; i < header_.titles; ++i)
+        {
+            const uint8_t shared = data[pos];
+            const uint8_t suffix = data[pos + 1];
+            int32_t count;
+
+            title.resize(shared);
+            title.append(data.data() + pos + 2, suffix);
+            std::memcpy(&count, data.data() + pos + 2 + suffix, sizeof(count));
+            pos += 2 + suffix + sizeof(count);
+
+            add(title, count);
+        }
+
+        return header_.entries == entries;
+    }
+
+    void close()
+    {
+        if (fd_ >= 0)
+        {
+            flush();
+            ::close(fd_);
+            fd_ = -1;
+        }
+        reset();
+    }
+
+    int64_t entries() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return header_.entries;
+    }
+
+    void rebuild(std::vector<string> titles)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        header_.clean = 0;
+        reset();
+        writeHeader();
+        ::fdatasync(fd_);
+
+        std::sort(titles.begin(), titles.end());
+
+        for (size_t i = 0; i < titles.size();)
+        {
+            size_t j = i + 1;
+
+            while (j < titles.size() && titles[j] == titles[i])
+            {
+                ++j;
+            }
+
+            add(titles[i], static_cast<int32_t>(j - i));
+            i = j;
+        }
+    }
+
+    void insert(const char* title)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        markDirty();
+        add(title, 1);
+    }
+
+    void erase(const char* title)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        markDirty();
+
+        if (removeBelow(root_, title))
+        {
+            --header_.entries;
+        }
+    }
+
+    // Distinct titles starting with prefix in byte order, each with the
+    // number of records carrying it; at most limit of them (0 means no
+    // limit).
+    std::vector<std::pair<string, int32_t>> complete(const string& prefix, const size_t limit) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        std::vector<std::pair<string, int32_t>> out;
+        const PrefixNode* node = &root_;
+        string path;
+        string_view rest = prefix;
+
+        while (!rest.empty())
+        {
+            const auto it = childAt(*node, rest[0]);
+
+            if (it == node->children.end() || (*it)->edge[0] != rest[0])
+            {
+                return out;
+            }
+
+            const string& edge = (*it)->edge;
+            const size_t n = std::min(edge.size(), rest.size());
+
+            if (rest.compare(0, n, edge, 0, n) != 0)
+            {
+                return out;
+            }
+
+            path += edge;
+            rest.remove_prefix(n);
+            node = it->get();
+        }
+
+        collect(*node, path, limit, out);
+
+        return out;
+    }
+
+    // Writes every title out and marks the file clean.
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (fd_ < 0 || header_.clean != 0)
+        {
+            return;
+        }
+
+        std::vector<std::pair<string, int32_t>> titles;
+        string path;
+        collect(root_, path, 0, titles);
+
+        std::vector<char> data;
+        const string* prev = nullptr;
+
+        for (const auto& [title, count] : titles)
+        {
+            const size_t shared = prev == nullptr ? 0 :
+                std::mismatch(prev->begin(), prev->end(), title.begin(), title.end()).first - prev->begin();
+
+            data.push_back(static_cast<char>(shared));
+            data.push_back(static_cast<char>(title.size() - shared));
+            data.insert(data.end(), title.begin() + shared, title.end());
+            data.insert(data.end(), reinterpret_cast<const char*>(&count),
+                        reinterpret_cast<const char*>(&count) + sizeof(count));
+
+            prev = &title;
+        }
+
+        header_.titles = titles.size();
+        header_.bytes = data.size();
+
+        if (::ftruncate(fd_, sizeof(header_) + data.size()) != 0)
+        {
+            throw std::runtime_error("Couldn't resize prefix index");
+        }
+
+        writeAt(sizeof(header_), data.data(), data.size());
+        ::fdatasync(fd_);
+
+        header_.clean = 1;
+        writeHeader();
+        ::fdatasync(fd_);
+    }
+};
+
+#endif
@@ -0,0 +1,703 @@
+#ifndef PRICE_INDEX_H
+#define PRICE_INDEX_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Entries are ordered by price, then id, so equal prices still give
+// unique keys and an entry can be found again to delete it.
+struct PriceKey
+{
+    double price;
+    int32_t id;
+};
+
+inline bool operator<(const PriceKey& a, const PriceKey& b)
+{
+    return a.price < b.price || (a.price == b.price && a.id < b.id);
+}
+
+inline bool operator==(const PriceKey& a, const PriceKey& b)
+{
+    return a.price == b.price && a.id == b.id;
+}
+
+constexpr int32_t kIndexPageSize = 4096;
+constexpr int32_t kNodeKeys = 203;
+constexpr uint32_t kIndexMagic = 0x32444950;
+
+// Leaves kept in memory beyond the inner nodes before dirty ones are
+// written back and all are dropped (8 MiB).
+constexpr size_t kIndexCachedLeaves = 2048;
+
+// free heads the list of released pages, linked through their next.
+struct IndexHeader
+{
+    uint32_t magic;
+    int32_t root;
+    int32_t pages;
+    int32_t height;
+    int64_t entries;
+    int32_t clean;
+    int32_t free;
+};
+
+// Leaves hold up to kNodeKeys keys and link to their right sibling; an
+// inner node with count keys has count + 1 children, and child i holds
+// the keys k with keys[i - 1] <= k < keys[i].
+struct IndexNode
+{
+    int32_t leaf;
+    int32_t count;
+    int32_t next;
+    int32_t reserved;
+    PriceKey keys[kNodeKeys];
+    int32_t children[kNodeKeys + 1];
+};
+
+static_assert(sizeof(IndexNode) <= kIndexPageSize, "Index node must fit into one page");
+
+// B+tree over (price, id) in its own file, one node per page after the
+// header page. Nodes are cached in memory and changed there: inner nodes
+// stay cached, leaves until kIndexCachedLeaves of them are, and changed
+// nodes reach the file when the cache is trimmed or on flush(). A leaf
+// that loses its last key is unlinked and its page put on a free list,
+// as is an inner node that loses its last child; rebuild() packs the
+// tree again. Like the table header, the index header is marked dirty
+// before the first change and only written back, clean, by flush(), so
+// an index that wasn't flushed after its last change is not trusted by
+// open().
+class PriceIndex
+{
+private:
+    string path_;
+    int fd_ = -1;
+    IndexHeader header_{};
+    mutable std::unordered_map<int32_t, IndexNode> nodes_;
+    mutable std::unordered_set<int32_t> dirty_;
+    mutable size_t cached_leaves_ = 0;
+    mutable std::mutex mutex_;
+
+    void readAt(const off_t offset, void* buf, const size_t len) const
+    {
+        char* ptr = static_cast<char*>(buf);
+        size_t done = 0;
+
+        while (done < len)
+        {
+            const ssize_t n = ::pread(fd_, ptr + done, len - done, offset + done);
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                throw std::runtime_error("Couldn't read price index");
+            }
+            done += n;
+        }
+    }
+
+    void writeAt(const off_t offset, const void* buf, const size_t len) const
+    {
+        const char* ptr = static_cast<const char*>(buf);
+        size_t done = 0;
+
+        while (done < len)
+        {
+            const ssize_t n = ::pwrite(fd_, ptr + done, len - done, offset + done);
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                throw std::runtime_error("Couldn't write price index");
+            }
+            done += n;
+        }
+    }
+
+    void readNode(const int32_t page, IndexNode& node) const
+    {
+        readAt(static_cast<off_t>(page) * kIndexPageSize, &node, sizeof(IndexNode));
+    }
+
+    void writeNode(const int32_t page, const IndexNode& node) const
+    {
+        writeAt(static_cast<off_t>(page) * kIndexPageSize, &node, sizeof(IndexNode));
+    }
+
+    void writeHeader() const
+    {
+        writeAt(0, &header_, sizeof(header_));
+    }
+
+    // References stay valid until the next trimCache() or dropCache().
+    IndexNode& node(const int32_t page) const
+    {
+        const auto it = nodes_.find(page);
+
+        if (it != nodes_.end())
+        {
+            return it->second;
+        }
+
+        IndexNode& cached = nodes_[page];
+        readNode(page, cached);
+
+        if (cached.leaf)
+        {
+            ++cached_leaves_;
+        }
+        return cached;
+    }
+
+    IndexNode& changeNode(const int32_t page)
+    {
+        dirty_.insert(page);
+        return node(page);
+    }
+
+    IndexNode& newNode(const int32_t page, const bool leaf)
+    {
+        const auto it = nodes_.find(page);
+
+        if (it == nodes_.end() || !it->second.leaf)
+        {
+            cached_leaves_ += leaf;
+        }
+        else if (!leaf)
+        {
+            --cached_leaves_;
+        }
+
+        dirty_.insert(page);
+        return nodes_[page] = emptyNode(leaf);
+    }
+
+    void writeBack() const
+    {
+        for (const int32_t page : dirty_)
+        {
+            writeNode(page, nodes_.at(page));
+        }
+        dirty_.clear();
+    }
+
+    // Called once an operation no longer holds node references.
+    void trimCache() const
+    {
+        if (cached_leaves_ <= kIndexCachedLeaves)
+        {
+            return;
+        }
+
+        writeBack();
+
+        for (auto it = nodes_.begin(); it != nodes_.end();)
+        {
+            it = it->second.leaf ? nodes_.erase(it) : std::next(it);
+        }
+        cached_leaves_ = 0;
+    }
+
+    void dropCache()
+    {
+        nodes_.clear();
+        dirty_.clear();
+        cached_leaves_ = 0;
+    }
+
+    void markDirty()
+    {
+        if (header_.clean != 0)
+        {
+            header_.clean = 0;
+            writeHeader();
+            ::fdatasync(fd_);
+        }
+    }
+
+    int32_t allocate()
+    {
+        if (header_.free < 0)
+        {
+            return header_.pages++;
+        }
+
+        const int32_t page = header_.free;
+        header_.free = node(page).next;
+        return page;
+    }
+
+    // Puts page on the free list; freed pages are kept as empty leaves.
+    void release(const int32_t page)
+    {
+        newNode(page, true).next = header_.free;
+        header_.free = page;
+    }
+
+    static IndexNode emptyNode(const bool leaf)
+    {
+        IndexNode node{};
+        node.leaf = leaf;
+        node.next = -1;
+        return node;
+    }
+
+    // Inserts key below page. Returns true if the node had to split, with
+    // the separator and the new right node in sep and right.
+    bool insertAt(const int32_t page, const PriceKey& key, bool& added, PriceKey& sep, int32_t& right)
+    {
+        IndexNode& node = this->node(page);
+
+        if (node.leaf)
+        {
+            const int32_t pos = std::lower_bound(node.keys, node.keys + node.count, key) - node.keys;
+
+            if (pos < node.count && node.keys[pos] == key)
+            {
+                return false;
+            }
+
+            std::copy_backward(node.keys + pos, node.keys + node.count, node.keys + node.count + 1);
+            node.keys[pos] = key;
+            ++node.count;
+            dirty_.insert(page);
+            added = true;
+        }
+        else
+        {
+            const int32_t idx = std::upper_bound(node.keys, node.keys + node.count, key) - node.keys;
+            PriceKey child_sep;
+            int32_t child_right;
+
+            if (!insertAt(node.children[idx], key, added, child_sep, child_right))
+            {
+                return false;
+            }
+
+            std::copy_backward(node.keys + idx, node.keys + node.count, node.keys + node.count + 1);
+            std::copy_backward(node.children + idx + 1, node.children + node.count + 1,
+                               node.children + node.count + 2);
+            node.keys[idx] = child_sep;
+            node.children[idx + 1] = child_right;
+            ++node.count;
+            dirty_.insert(page);
+        }
+
+        if (node.count < kNodeKeys)
+        {
+            return false;
+        }
+
+        const int32_t mid = node.count / 2;
+        right = allocate();
+        IndexNode& sibling = newNode(right, node.leaf);
+
+        if (node.leaf)
+        {
+            sibling.count = node.count - mid;
+            std::copy(node.keys + mid, node.keys + node.count, sibling.keys);
+            sibling.next = node.next;
+            node.next = right;
+            sep = sibling.keys[0];
+        }
+        else
+        {
+            sibling.count = node.count - mid - 1;
+            std::copy(node.keys + mid + 1, node.keys + node.count, sibling.keys);
+            std::copy(node.children + mid + 1, node.children + node.count + 1, sibling.children);
+            sep = node.keys[mid];
+        }
+        node.count = mid;
+        return true;
+    }
+
+    // Rightmost leaf below page, which is height levels above the leaves.
+    int32_t lastLeaf(int32_t page, int32_t height) const
+    {
+        for (; height > 1; --height)
+        {
+            const IndexNode& inner = node(page);
+            page = inner.children[inner.count];
+        }
+        return page;
+    }
+
+    // Removes key below page, height levels above the leaves; left is
+    // the leaf just before page's subtree, -1 at the left edge. Returns
+    // true if page lost its last key or child and was released, so the
+    // parent has to drop it.
+    bool eraseAt(const int32_t page, const int32_t height, const PriceKey& key, const int32_t left,
+                 bool& removed)
+    {
+        IndexNode& node = this->node(page);
+
+        if (node.leaf)
+        {
+            const int32_t pos = std::lower_bound(node.keys, node.keys + node.count, key) - node.keys;
+
+            if (pos == node.count || !(node.keys[pos] == key))
+            {
+                return false;
+            }
+
+            std::copy(node.keys + pos + 1, node.keys + node.count, node.keys + pos);
+            --node.count;
+            dirty_.insert(page);
+            removed = true;
+
+            if (node.count > 0 || page == header_.root)
+            {
+                return false;
+            }
+
+            if (left >= 0)
+            {
+                changeNode(left).next = node.next;
+            }
+            release(page);
+            return true;
+        }
+
+        const int32_t idx = std::upper_bound(node.keys, node.keys + node.count, key) - node.keys;
+        const int32_t child_left = idx > 0 ? lastLeaf(node.children[idx - 1], height - 1) : left;
+
+        if (!eraseAt(node.children[idx], height - 1, key, child_left, removed))
+        {
+            return false;
+        }
+
+        dirty_.insert(page);
+
+        if (node.count == 0)
+        {
+            release(page);
+            return true;
+        }
+
+        // The child's range joins its left neighbour's, or for the first
+        // child the next one's.
+        const int32_t sep = idx > 0 ? idx - 1 : 0;
+        std::copy(node.keys + sep + 1, node.keys + node.count, node.keys + sep);
+        std::copy(node.children + idx + 1, node.children + node.count + 1, node.children + idx);
+        --node.count;
+        return false;
+    }
+
+    // Leaf that would hold key.
+    const IndexNode& findLeaf(const PriceKey& key) const
+    {
+        const IndexNode* current = &node(header_.root);
+
+        while (!current->leaf)
+        {
+            current = &node(current->children[std::upper_bound(current->keys, current->keys + current->count, key) -
+                                              current->keys]);
+        }
+
+        return *current;
+    }
+
+public:
+    explicit PriceIndex(string path) : path_(std::move(path))
+    {
+    }
+
+    ~PriceIndex()
+    {
+        close();
+    }
+
+    PriceIndex(const PriceIndex&) = delete;
+    PriceIndex& operator=(const PriceIndex&) = delete;
+
+    const string& path() const
+    {
+        return path_;
+    }
+
+    // Returns false if the file is new, foreign or wasn't flushed after
+    // its last change; it then has to be rebuilt before use.
+    bool open()
+    {
+        close();
+
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+
+        if (fd_ < 0)
+        {
+            throw std::runtime_error("Price index file didn't open");
+        }
+
+        if (::pread(fd_, &header_, sizeof(header_), 0) != static_cast<ssize_t>(sizeof(header_)) ||
+            header_.magic != kIndexMagic || header_.clean == 0)
+        {
+            header_ = IndexHeader{kIndexMagic, -1, 1, 0, 0, 0, -1};
+            return false;
+        }
+
+        return true;
+    }
+
+    void close()
+    {
+        if (fd_ >= 0)
+        {
+            flush();
+            ::close(fd_);
+            fd_ = -1;
+        }
+        dropCache();
+    }
+
+    int64_t entries() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return header_.entries;
+    }
+
+    // Replaces the whole tree by one bulk loaded from keys, with nodes
+    // filled to three quarters so that inserts don't split right away.
+    void rebuild(std::vector<PriceKey> keys)
+    {
+        constexpr int32_t kFill = kNodeKeys * 3 / 4;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        if (::ftruncate(fd_, 0) != 0)
+        {
+            throw std::runtime_error("Couldn't truncate price index");
+        }
+
+        dropCache();
+
+        header_ = IndexHeader{kIndexMagic, -1, 1, 0, static_cast<int64_t>(keys.size()), 0, -1};
+
+        if (keys.empty())
+        {
+            writeHeader();
+            return;
+        }
+
+        // First key and page of every node on the level being built.
+        std::vector<std::pair<PriceKey, int32_t>> level;
+
+        const size_t leaves = (keys.size() + kFill - 1) / kFill;
+
+        for (size_t i = 0; i < leaves; ++i)
+        {
+            IndexNode node = emptyNode(true);
+            const size_t first = i * kFill;
+
+            node.count = static_cast<int32_t>(std::min<size_t>(kFill, keys.size() - first));
+            std::copy(keys.begin() + first, keys.begin() + first + node.count, node.keys);
+
+            const int32_t page = allocate();
+            node.next = i + 1 < leaves ? page + 1 : -1;
+
+            writeNode(page, node);
+            level.emplace_back(node.keys[0], page);
+        }
+
+        header_.height = 1;
+
+        while (level.size() > 1)
+        {
+            std::vector<std::pair<PriceKey, int32_t>> parents;
+
+            for (size_t first = 0; first < level.size(); first += kFill + 1)
+            {
+                const size_t n = std::min<size_t>(kFill + 1, level.size() - first);
+                IndexNode node = emptyNode(false);
+
+                node.count = static_cast<int32_t>(n) - 1;
+
+                for (size_t i = 0; i < n; ++i)
+                {
+                    node.children[i] = level[first + i].second;
+
+                    if (i > 0)
+                    {
+                        node.keys[i - 1] = level[first + i].first;
+                    }
+                }
+
+                const int32_t page = allocate();
+                writeNode(page, node);
+                parents.emplace_back(level[first].first, page);
+            }
+
+            level.swap(parents);
+            ++header_.height;
+        }
+
+        header_.root = level[0].second;
+        writeHeader();
+    }
+
+    void insert(const double price, const int32_t id)
+    {
+        const PriceKey key{price, id};
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        markDirty();
+
+        if (header_.root < 0)
+        {
+            header_.root = allocate();
+            header_.height = 1;
+            newNode(header_.root, true);
+        }
+
+        bool added = false;
+        PriceKey sep;
+        int32_t right;
+
+        if (insertAt(header_.root, key, added, sep, right))
+        {
+            const int32_t page = allocate();
+            IndexNode& root = newNode(page, false);
+
+            root.count = 1;
+            root.keys[0] = sep;
+            root.children[0] = header_.root;
+            root.children[1] = right;
+
+            header_.root = page;
+            ++header_.height;
+        }
+
+        if (added)
+        {
+            ++header_.entries;
+        }
+
+        trimCache();
+    }
+
+    void erase(const double price, const int32_t id)
+    {
+        const PriceKey key{price, id};
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (header_.root < 0)
+        {
+            return;
+        }
+
+        const IndexNode& leaf = findLeaf(key);
+
+        if (!std::binary_search(leaf.keys, leaf.keys + leaf.count, key))
+        {
+            trimCache();
+            return;
+        }
+
+        markDirty();
+
+        bool removed = false;
+        eraseAt(header_.root, header_.height, key, -1, removed);
+
+        // An inner root left with a single child gives way to it.
+        while (header_.height > 1 && node(header_.root).count == 0)
+        {
+            const int32_t page = header_.root;
+            header_.root = node(page).children[0];
+            --header_.height;
+            release(page);
+        }
+
+        if (removed)
+        {
+            --header_.entries;
+        }
+
+        trimCache();
+    }
+
+    // Ids of the entries with min <= price <= max in key order, at most
+    // limit of them (0 means no limit).
+    std::vector<int32_t> range(const double min, const double max, const size_t limit) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        std::vector<int32_t> ids;
+
+        if (header_.root < 0)
+        {
+            return ids;
+        }
+
+        const PriceKey from{min, std::numeric_limits<int32_t>::min()};
+        const IndexNode* leaf = &findLeaf(from);
+
+        int32_t pos = std::lower_bound(leaf->keys, leaf->keys + leaf->count, from) - leaf->keys;
+        bool done = false;
+
+        while (!done)
+        {
+            for (; pos < leaf->count; ++pos)
+            {
+                if (leaf->keys[pos].price > max || (limit != 0 && ids.size() == limit))
+                {
+                    done = true;
+                    break;
+                }
+                ids.push_back(leaf->keys[pos].id);
+            }
+
+            if (done || leaf->next < 0)
+            {
+                break;
+            }
+
+            leaf = &node(leaf->next);
+            pos = 0;
+        }
+
+        trimCache();
+        return ids;
+    }
+
+    // Makes every change so far durable and marks the file clean.
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (fd_ < 0 || header_.clean != 0)
+        {
+            return;
+        }
+
+        writeBack();
+        ::fdatasync(fd_);
+        header_.clean = 1;
+        writeHeader();
+        ::fdatasync(fd_);
+    }
+};
+
+#endif
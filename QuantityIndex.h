@@ -0,0 +1,294 @@
+#ifndef QUANTITY_INDEX_H
+#define QUANTITY_INDEX_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "RoaringBitmap.h"
+
+using namespace std;
+
+constexpr uint32_t kQuantityIndexMagic = 0x58444951;
+
+struct QuantityIndexHeader
+{
+    uint32_t magic;
+    int32_t clean;
+    int64_t entries;
+    int64_t values;
+    int64_t bytes;
+};
+
+// Bitmap index on quantity: one roaring bitmap of ids per distinct
+// quantity. Quantities repeat a lot, so the bitmaps stay compact and
+// counts come straight from their cardinalities. Bitmaps live in memory
+// and are written out as a whole by flush(); as with the other indexes
+// the header is marked dirty before the first change after that.
+class QuantityIndex
+{
+private:
+    string path_;
+    int fd_ = -1;
+    QuantityIndexHeader header_{};
+    std::map<int32_t, RoaringBitmap> values_;
+    mutable std::mutex mutex_;
+
+    void readAt(const off_t offset, void* buf, const size_t len) const
+    {
+        char* ptr = static_cast<char*>(buf);
+        size_t done = 0;
+
+        while (done < len)
+        {
+            const ssize_t n = ::pread(fd_, ptr + done, len - done, offset + done);
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                throw std::runtime_error("Couldn't read quantity index");
+            }
+            done += n;
+        }
+    }
+
+    void writeAt(const off_t offset, const void* buf, const size_t len) const
+    {
+        const char* ptr = static_cast<const char*>(buf);
+        size_t done = 0;
+
+        while (done < len)
+        {
+            const ssize_t n = ::pwrite(fd_, ptr + done, len - done, offset + done);
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                throw std::runtime_error("Couldn't write quantity index");
+            }
+            done += n;
+        }
+    }
+
+    void writeHeader() const
+    {
+        writeAt(0, &header_, sizeof(header_));
+    }
+
+    void markDirty()
+    {
+        if (header_.clean != 0)
+        {
+            header_.clean = 0;
+            writeHeader();
+            ::fdatasync(fd_);
+        }
+    }
+
+public:
+    explicit QuantityIndex(string path) : path_(std::move(path))
+    {
+    }
+
+    ~QuantityIndex()
+    {
+        close();
+    }
+
+    QuantityIndex(const QuantityIndex&) = delete;
+    QuantityIndex& operator=(const QuantityIndex&) = delete;
+
+    // Returns false if the file is new, foreign or wasn't flushed after
+    // its last change; it then has to be rebuilt before use.
+    bool open()
+    {
+        close();
+
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+
+        if (fd_ < 0)
+        {
+            throw std::runtime_error("Quantity index file didn't open");
+        }
+
+        if (::pread(fd_, &header_, sizeof(header_), 0) != static_cast<ssize_t>(sizeof(header_)) ||
+            header_.magic != kQuantityIndexMagic || header_.clean == 0)
+        {
+            header_ = QuantityIndexHeader{kQuantityIndexMagic, 0, 0, 0, 0};
+            return false;
+        }
+
+        std::vector<char> data(header_.bytes);
+        readAt(sizeof(header_), data.data(), data.size());
+
+        size_t pos = 0;
+        int64_t entries = 0;
+
+        for (int64_t i = 0; i < header_.values; ++i)
+        {
+            int32_t quantity;
+
+            if (data.size() - pos < sizeof(quantity))
+            {
+                return false;
+            }
+            std::memcpy(&quantity, data.data() + pos, sizeof(quantity));
+            pos += sizeof(quantity);
+
+            RoaringBitmap& ids = values_[quantity];
+
+            if (!ids.deserialize(data, pos))
+            {
+                return false;
+            }
+            entries += ids.cardinality();
+        }
+
+        return entries == header_.entries;
+    }
+
+    void close()
+    {
+        if (fd_ >= 0)
+        {
+            flush();
+            ::close(fd_);
+            fd_ = -1;
+        }
+        values_.clear();
+    }
+
+    int64_t entries() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return header_.entries;
+    }
+
+    // Replaces the index with these (quantity, id) pairs.
+    void rebuild(const std::vector<std::pair<int32_t, int32_t>>& entries)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        header_ = QuantityIndexHeader{kQuantityIndexMagic, 0, 0, 0, 0};
+        writeHeader();
+        ::fdatasync(fd_);
+
+        values_.clear();
+
+        for (const auto& [quantity, id] : entries)
+        {
+            header_.entries += values_[quantity].add(id);
+        }
+    }
+
+    void insert(const int32_t quantity, const int32_t id)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        markDirty();
+        header_.entries += values_[quantity].add(id);
+    }
+
+    void erase(const int32_t quantity, const int32_t id)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        const auto it = values_.find(quantity);
+
+        if (it == values_.end())
+        {
+            return;
+        }
+
+        markDirty();
+
+        if (it->second.remove(id))
+        {
+            --header_.entries;
+        }
+        if (it->second.empty())
+        {
+            values_.erase(it);
+        }
+    }
+
+    // Ids with min <= quantity <= max, as one bitmap.
+    RoaringBitmap matching(const int32_t min, const int32_t max) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        RoaringBitmap result;
+
+        for (auto it = values_.lower_bound(min); it != values_.end() && it->first <= max; ++it)
+        {
+            result |= it->second;
+        }
+
+        return result;
+    }
+
+    // How many ids have min <= quantity <= max; every id has a single
+    // quantity, so this is a sum of cardinalities.
+    int64_t count(const int32_t min, const int32_t max) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        int64_t result = 0;
+
+        for (auto it = values_.lower_bound(min); it != values_.end() && it->first <= max; ++it)
+        {
+            result += it->second.cardinality();
+        }
+
+        return result;
+    }
+
+    // Writes every bitmap out and marks the file clean.
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (fd_ < 0 || header_.clean != 0)
+        {
+            return;
+        }
+
+        std::vector<char> data;
+
+        for (const auto& [quantity, ids] : values_)
+        {
+            const char* bytes = reinterpret_cast<const char*>(&quantity);
+            data.insert(data.end(), bytes, bytes + sizeof(quantity));
+            ids.serialize(data);
+        }
+
+        header_.values = values_.size();
+        header_.bytes = data.size();
+
+        if (::ftruncate(fd_, sizeof(header_) + data.size()) != 0)
+        {
+            throw std::runtime_error("Couldn't resize quantity index");
+        }
+
+        writeAt(sizeof(header_), data.data(), data.size());
+        ::fdatasync(fd_);
+
+        header_.clean = 1;
+        writeHeader();
+        ::fdatasync(fd_);
+    }
+};
+
+#endif
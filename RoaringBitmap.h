@@ -0,0 +1,467 @@
+#ifndef ROARING_BITMAP_H
+#define ROARING_BITMAP_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+// A container switches between a sorted array and a bitmap at this many
+// values, where both take 8 KiB.
+constexpr int32_t kRoaringArrayMax = 4096;
+constexpr int32_t kRoaringWords = 1024;
+
+// Set of uint32 values in the roaring layout: values are grouped by their
+// high 16 bits into containers, each holding the low 16 bits either as a
+// sorted array (sparse) or as a 65536-bit bitmap (dense).
+class RoaringBitmap
+{
+private:
+    struct Container
+    {
+        uint16_t key = 0;
+        int32_t card = 0;
+        std::vector<uint16_t> array;
+        std::vector<uint64_t> bits;
+
+        bool dense() const
+        {
+            return !bits.empty();
+        }
+
+        std::vector<uint64_t> words() const
+        {
+            if (dense())
+            {
+                return bits;
+            }
+
+            std::vector<uint64_t> result(kRoaringWords);
+
+            for (const uint16_t low : array)
+            {
+                result[low >> 6] |= uint64_t(1) << (low & 63);
+            }
+
+            return result;
+        }
+
+        // Picks the representation that fits card.
+        void normalize()
+        {
+            if (dense() && card <= kRoaringArrayMax)
+            {
+                array.clear();
+
+                for (int32_t w = 0; w < kRoaringWords; ++w)
+                {
+                    for (uint64_t word = bits[w]; word != 0; word &= word - 1)
+                    {
+                        array.push_back(static_cast<uint16_t>(w * 64 + __builtin_ctzll(word)));
+                    }
+                }
+                bits.clear();
+                bits.shrink_to_fit();
+            }
+            else if (!dense() && card > kRoaringArrayMax)
+            {
+                bits = words();
+                array.clear();
+                array.shrink_to_fit();
+            }
+        }
+    };
+
+    std::vector<Container> containers_;
+
+    std::vector<Container>::iterator containerAt(const uint16_t key)
+    {
+        return std::lower_bound(containers_.begin(), containers_.end(), key,
+                                [](const Container& c, const uint16_t value) { return c.key < value; });
+    }
+
+    static Container fromWords(const uint16_t key, std::vector<uint64_t> words)
+    {
+        Container c;
+        c.key = key;
+
+        for (const uint64_t word : words)
+        {
+            c.card += __builtin_popcountll(word);
+        }
+
+        c.bits = std::move(words);
+        c.normalize();
+
+        return c;
+    }
+
+public:
+    // Returns false if value was there already.
+    bool add(const uint32_t value)
+    {
+        const uint16_t key = value >> 16;
+        const uint16_t low = value & 0xFFFF;
+        auto it = containerAt(key);
+
+        if (it == containers_.end() || it->key != key)
+        {
+            it = containers_.insert(it, Container());
+            it->key = key;
+        }
+
+        if (it->dense())
+        {
+            uint64_t& word = it->bits[low >> 6];
+            const uint64_t bit = uint64_t(1) << (low & 63);
+
+            if ((word & bit) != 0)
+            {
+                return false;
+            }
+            word |= bit;
+        }
+        else
+        {
+            const auto pos = std::lower_bound(it->array.begin(), it->array.end(), low);
+
+            if (pos != it->array.end() && *pos == low)
+            {
+                return false;
+            }
+            it->array.insert(pos, low);
+        }
+
+        ++it->card;
+        it->normalize();
+        return true;
+    }
+
+    // Returns false if value wasn't there.
+    bool remove(const uint32_t value)
+    {
+        const uint16_t key = value >> 16;
+        const uint16_t low = value & 0xFFFF;
+        const auto it = containerAt(key);
+
+        if (it == containers_.end() || it->key != key)
+        {
+            return false;
+        }
+
+        if (it->dense())
+        {
+            uint64_t& word = it->bits[low >> 6];
+            const uint64_t bit = uint64_t(1) << (low & 63);
+
+            if ((word & bit) == 0)
+            {
+                return false;
+            }
+            word &= ~bit;
+        }
+        else
+        {
+            const auto pos = std::lower_bound(it->array.begin(), it->array.end(), low);
+
+            if (pos == it->array.end() || *pos != low)
+            {
+                return false;
+            }
+            it->array.erase(pos);
+        }
+
+        if (--it->card == 0)
+        {
+            containers_.erase(it);
+        }
+        else
+        {
+            it->normalize();
+        }
+        return true;
+    }
+
+    // Adds values given in any order. They are set in one bitmap per
+    // container first, so this stays linear where add() would keep
+    // shifting the arrays.
+    template <class Values>
+    void addAll(const Values& values)
+    {
+        std::map<uint16_t, std::vector<uint64_t>> words;
+
+        for (const auto value : values)
+        {
+            const uint32_t v = static_cast<uint32_t>(value);
+            std::vector<uint64_t>& w = words[v >> 16];
+
+            if (w.empty())
+            {
+                w.resize(kRoaringWords);
+            }
+            w[(v & 0xFFFF) >> 6] |= uint64_t(1) << (v & 63);
+        }
+
+        RoaringBitmap added;
+
+        for (auto& [key, w] : words)
+        {
+            added.containers_.push_back(fromWords(key, std::move(w)));
+        }
+
+        *this |= added;
+    }
+
+    int64_t cardinality() const
+    {
+        int64_t result = 0;
+
+        for (const Container& c : containers_)
+        {
+            result += c.card;
+        }
+
+        return result;
+    }
+
+    bool empty() const
+    {
+        return containers_.empty();
+    }
+
+    // Calls f(value) for every value in ascending order.
+    template <class F>
+    void forEach(F f) const
+    {
+        for (const Container& c : containers_)
+        {
+            const uint32_t high = static_cast<uint32_t>(c.key) << 16;
+
+            if (c.dense())
+            {
+                for (int32_t w = 0; w < kRoaringWords; ++w)
+                {
+                    for (uint64_t word = c.bits[w]; word != 0; word &= word - 1)
+                    {
+                        f(high | static_cast<uint32_t>(w * 64 + __builtin_ctzll(word)));
+                    }
+                }
+            }
+            else
+            {
+                for (const uint16_t low : c.array)
+                {
+                    f(high | low);
+                }
+            }
+        }
+    }
+
+    RoaringBitmap& operator|=(const RoaringBitmap& other)
+    {
+        std::vector<Container> result;
+        auto a = containers_.begin();
+        auto b = other.containers_.begin();
+
+        while (a != containers_.end() || b != other.containers_.end())
+        {
+            if (b == other.containers_.end() || (a != containers_.end() && a->key < b->key))
+            {
+                result.push_back(std::move(*a++));
+            }
+            else if (a == containers_.end() || b->key < a->key)
+            {
+                result.push_back(*b++);
+            }
+            else if (!a->dense() && !b->dense())
+            {
+                Container c;
+                c.key = a->key;
+                std::set_union(a->array.begin(), a->array.end(), b->array.begin(), b->array.end(),
+                               std::back_inserter(c.array));
+                c.card = static_cast<int32_t>(c.array.size());
+                c.normalize();
+                result.push_back(std::move(c));
+                ++a;
+                ++b;
+            }
+            else
+            {
+                std::vector<uint64_t> words = a->words();
+                const std::vector<uint64_t> other_words = b->words();
+
+                for (int32_t w = 0; w < kRoaringWords; ++w)
+                {
+                    words[w] |= other_words[w];
+                }
+                result.push_back(fromWords(a->key, std::move(words)));
+                ++a;
+                ++b;
+            }
+        }
+
+        containers_.swap(result);
+        return *this;
+    }
+
+    RoaringBitmap& operator&=(const RoaringBitmap& other)
+    {
+        std::vector<Container> result;
+        auto a = containers_.begin();
+        auto b = other.containers_.begin();
+
+        while (a != containers_.end() && b != other.containers_.end())
+        {
+            if (a->key < b->key)
+            {
+                ++a;
+                continue;
+            }
+            if (b->key < a->key)
+            {
+                ++b;
+                continue;
+            }
+
+            Container c;
+
+            if (!a->dense() || !b->dense())
+            {
+                // A sparse side bounds the result; test its values
+                // against the other side.
+                const Container& sparse = a->dense() ? *b : *a;
+                const Container& rest = a->dense() ? *a : *b;
+
+                c.key = a->key;
+
+                for (const uint16_t low : sparse.array)
+                {
+                    const bool hit = rest.dense()
+                        ? (rest.bits[low >> 6] >> (low & 63) & 1) != 0
+                        : std::binary_search(rest.array.begin(), rest.array.end(), low);
+
+                    if (hit)
+                    {
+                        c.array.push_back(low);
+                    }
+                }
+                c.card = static_cast<int32_t>(c.array.size());
+            }
+            else
+            {
+                std::vector<uint64_t> words = a->bits;
+
+                for (int32_t w = 0; w < kRoaringWords; ++w)
+                {
+                    words[w] &= b->bits[w];
+                }
+                c = fromWords(a->key, std::move(words));
+            }
+
+            if (c.card > 0)
+            {
+                result.push_back(std::move(c));
+            }
+            ++a;
+            ++b;
+        }
+
+        containers_.swap(result);
+        return *this;
+    }
+
+    // Appends the bitmap to out: the number of containers, then per
+    // container its key, its cardinality and either the array or the
+    // bitmap words, depending on the cardinality.
+    void serialize(std::vector<char>& out) const
+    {
+        const auto put = [&](const void* data, const size_t len)
+        {
+            const char* bytes = static_cast<const char*>(data);
+            out.insert(out.end(), bytes, bytes + len);
+        };
+
+        const uint32_t n = static_cast<uint32_t>(containers_.size());
+        put(&n, sizeof(n));
+
+        for (const Container& c : containers_)
+        {
+            put(&c.key, sizeof(c.key));
+            put(&c.card, sizeof(c.card));
+
+            if (c.dense())
+            {
+                put(c.bits.data(), c.bits.size() * sizeof(uint64_t));
+            }
+            else
+            {
+                put(c.array.data(), c.array.size() * sizeof(uint16_t));
+            }
+        }
+    }
+
+    // Reads a bitmap written by serialize() starting at pos, which is
+    // moved past it. Returns false if data ends too early.
+    bool deserialize(const std::vector<char>& data, size_t& pos)
+    {
+        const auto get = [&](void* dest, const size_t len)
+        {
+            if (data.size() - pos < len)
+            {
+                return false;
+            }
+            std::memcpy(dest, data.data() + pos, len);
+            pos += len;
+            return true;
+        };
+
+        containers_.clear();
+
+        uint32_t n = 0;
+
+        if (!get(&n, sizeof(n)))
+        {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            Container c;
+
+            if (!get(&c.key, sizeof(c.key)) || !get(&c.card, sizeof(c.card)) ||
+                c.card <= 0 || c.card > kRoaringWords * 64)
+            {
+                return false;
+            }
+
+            if (c.card > kRoaringArrayMax)
+            {
+                c.bits.resize(kRoaringWords);
+
+                if (!get(c.bits.data(), c.bits.size() * sizeof(uint64_t)))
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                c.array.resize(c.card);
+
+                if (!get(c.array.data(), c.array.size() * sizeof(uint16_t)))
+                {
+                    return false;
+                }
+            }
+
+            containers_.push_back(std::move(c));
+        }
+
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,206 @@
+#ifndef SCAN_KERNELS_H
+#define SCAN_KERNELS_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "Table.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Predicate kernels for full scans. Each one looks at the n (<= 64)
+// slots of one bucket and returns a bitmask with bit i set when slot i
+// matches; liveness is left to the caller. The numeric kernels read the
+// bucket's shadow columns (see Table), the title kernels its records and
+// take the query zero-padded to the size of Record::title plus its
+// length, which must be shorter than that.
+
+constexpr double kPriceEpsilon = 1e-9;
+constexpr size_t kTitleSize = sizeof(Record::title);
+
+using QuantityKernel = uint64_t (*)(const int32_t* quantities, int32_t n, int32_t value);
+using PriceKernel = uint64_t (*)(const double* prices, int32_t n, double value);
+using TitleKernel = uint64_t (*)(const Record* slots, int32_t n, const char* title, size_t len);
+
+inline uint64_t matchQuantityScalar(const int32_t* quantities, const int32_t n, const int32_t value)
+{
+    uint64_t mask = 0;
+
+    for (int32_t i = 0; i < n; ++i)
+    {
+        mask |= static_cast<uint64_t>(quantities[i] == value) << i;
+    }
+
+    return mask;
+}
+
+inline uint64_t matchPriceScalar(const double* prices, const int32_t n, const double value)
+{
+    uint64_t mask = 0;
+
+    for (int32_t i = 0; i < n; ++i)
+    {
+        mask |= static_cast<uint64_t>(fabs(prices[i] - value) < kPriceEpsilon) << i;
+    }
+
+    return mask;
+}
+
+inline uint64_t matchTitleScalar(const Record* slots, const int32_t n, const char* title, size_t)
+{
+    uint64_t mask = 0;
+
+    for (int32_t i = 0; i < n; ++i)
+    {
+        mask |= static_cast<uint64_t>(strcmp(slots[i].title, title) == 0) << i;
+    }
+
+    return mask;
+}
+
+#ifdef __SSE2__
+// Compares the first 16 bytes of each title, up to and including the
+// query's terminator, and confirms the survivors with strcmp only if
+// the query is longer than that.
+inline uint64_t matchTitleSse2(const Record* slots, const int32_t n, const char* title, const size_t len)
+{
+    alignas(16) uint8_t care[16];
+
+    for (size_t i = 0; i < 16; ++i)
+    {
+        care[i] = i <= len ? 0xFF : 0x00;
+    }
+
+    const __m128i needle = _mm_loadu_si128(reinterpret_cast<const __m128i*>(title));
+    const __m128i ignore = _mm_xor_si128(_mm_load_si128(reinterpret_cast<const __m128i*>(care)), _mm_set1_epi8(-1));
+    uint64_t mask = 0;
+
+    for (int32_t i = 0; i < n; ++i)
+    {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(slots[i].title));
+        const __m128i same = _mm_or_si128(_mm_cmpeq_epi8(bytes, needle), ignore);
+
+        if (_mm_movemask_epi8(same) == 0xFFFF && (len < 16 || strcmp(slots[i].title, title) == 0))
+        {
+            mask |= uint64_t(1) << i;
+        }
+    }
+
+    return mask;
+}
+#endif
+
+#ifdef SCAN_KERNELS_X86
+// The last, partial vector is loaded with a mask, so nothing past n is
+// read.
+__attribute__((target("avx2")))
+inline uint64_t matchQuantityAvx2(const int32_t* quantities, const int32_t n, const int32_t value)
+{
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i needle = _mm256_set1_epi32(value);
+    uint64_t mask = 0;
+
+    for (int32_t i = 0; i < n; i += 8)
+    {
+        const __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(n - i), lane);
+        const __m256i quantity = _mm256_maskload_epi32(quantities + i, valid);
+        const __m256i hit = _mm256_and_si256(_mm256_cmpeq_epi32(quantity, needle), valid);
+
+        mask |= static_cast<uint64_t>(_mm256_movemask_ps(_mm256_castsi256_ps(hit))) << i;
+    }
+
+    return mask;
+}
+
+__attribute__((target("avx2")))
+inline uint64_t matchPriceAvx2(const double* prices, const int32_t n, const double value)
+{
+    const __m256i lane = _mm256_setr_epi64x(0, 1, 2, 3);
+    const __m256d needle = _mm256_set1_pd(value);
+    const __m256d epsilon = _mm256_set1_pd(kPriceEpsilon);
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    uint64_t mask = 0;
+
+    for (int32_t i = 0; i < n; i += 4)
+    {
+        const __m256i valid = _mm256_cmpgt_epi64(_mm256_set1_epi64x(n - i), lane);
+        const __m256d price = _mm256_maskload_pd(prices + i, valid);
+        const __m256d diff = _mm256_andnot_pd(sign, _mm256_sub_pd(price, needle));
+        const __m256d hit = _mm256_and_pd(_mm256_cmp_pd(diff, epsilon, _CMP_LT_OQ), _mm256_castsi256_pd(valid));
+
+        mask |= static_cast<uint64_t>(_mm256_movemask_pd(hit)) << i;
+    }
+
+    return mask;
+}
+
+// Same as the SSE2 version on 32 bytes; titles are 64 bytes long, so the
+// load stays inside the record.
+__attribute__((target("avx2")))
+inline uint64_t matchTitleAvx2(const Record* slots, const int32_t n, const char* title, const size_t len)
+{
+    alignas(32) uint8_t care[32];
+
+    for (size_t i = 0; i < 32; ++i)
+    {
+        care[i] = i <= len ? 0xFF : 0x00;
+    }
+
+    const __m256i needle = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(title));
+    const __m256i ignore = _mm256_xor_si256(_mm256_load_si256(reinterpret_cast<const __m256i*>(care)),
+                                            _mm256_set1_epi8(-1));
+    uint64_t mask = 0;
+
+    for (int32_t i = 0; i < n; ++i)
+    {
+        const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(slots[i].title));
+        const __m256i same = _mm256_or_si256(_mm256_cmpeq_epi8(bytes, needle), ignore);
+
+        if (_mm256_movemask_epi8(same) == -1 && (len < 32 || strcmp(slots[i].title, title) == 0))
+        {
+            mask |= uint64_t(1) << i;
+        }
+    }
+
+    return mask;
+}
+#endif
+
+struct ScanKernels
+{
+    const char* name;
+    QuantityKernel quantity;
+    PriceKernel price;
+    TitleKernel title;
+};
+
+// Picked once, by what the CPU running us supports.
+inline const ScanKernels& scanKernels()
+{
+    static const ScanKernels kernels = []
+    {
+#ifdef SCAN_KERNELS_X86
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return ScanKernels{"avx2", matchQuantityAvx2, matchPriceAvx2, matchTitleAvx2};
+        }
+#endif
+#ifdef __SSE2__
+        return ScanKernels{"sse2", matchQuantityScalar, matchPriceScalar, matchTitleSse2};
+#else
+        return ScanKernels{"scalar", matchQuantityScalar, matchPriceScalar, matchTitleScalar};
+#endif
+    }();
+
+    return kernels;
+}
+
+#endif
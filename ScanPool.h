@@ -0,0 +1,151 @@
+#ifndef SCAN_POOL_H
+#define SCAN_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Fixed set of worker threads for full-table scans. run(n, f) calls
+// f(0) .. f(n - 1) spread over the workers and the calling thread and
+// returns once all of them are done; the first exception thrown by a
+// task is rethrown to the caller. Runs from different threads take
+// turns, each one already uses every worker.
+class ScanPool
+{
+private:
+    std::vector<std::thread> workers_;
+    std::mutex run_mutex_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::condition_variable done_cv_;
+
+    const std::function<void(size_t)>* task_ = nullptr;
+    size_t tasks_ = 0;
+    size_t next_ = 0;
+    size_t finished_ = 0;
+    uint64_t generation_ = 0;
+    std::exception_ptr error_;
+    bool stop_ = false;
+
+    // Takes tasks of the current run until none are left; mutex_ is
+    // held on entry and on return.
+    void work(std::unique_lock<std::mutex>& lock)
+    {
+        while (next_ < tasks_)
+        {
+            const size_t i = next_++;
+            const std::function<void(size_t)>& task = *task_;
+
+            lock.unlock();
+
+            std::exception_ptr error;
+
+            try
+            {
+                task(i);
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            lock.lock();
+
+            if (error && !error_)
+            {
+                error_ = error;
+            }
+
+            if (++finished_ == tasks_)
+            {
+                done_cv_.notify_all();
+            }
+        }
+    }
+
+public:
+    explicit ScanPool(const size_t threads)
+    {
+        for (size_t i = 1; i < std::max<size_t>(threads, 1); ++i)
+        {
+            workers_.emplace_back([this]
+            {
+                uint64_t seen = 0;
+                std::unique_lock<std::mutex> lock(mutex_);
+
+                while (true)
+                {
+                    cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+
+                    if (stop_)
+                    {
+                        return;
+                    }
+
+                    seen = generation_;
+                    work(lock);
+                }
+            });
+        }
+    }
+
+    ~ScanPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+
+        for (auto& worker : workers_)
+        {
+            worker.join();
+        }
+    }
+
+    ScanPool(const ScanPool&) = delete;
+    ScanPool& operator=(const ScanPool&) = delete;
+
+    size_t size() const
+    {
+        return workers_.size() + 1;
+    }
+
+    void run(const size_t n, const std::function<void(size_t)>& f)
+    {
+        std::lock_guard<std::mutex> serial(run_mutex_);
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        task_ = &f;
+        tasks_ = n;
+        next_ = 0;
+        finished_ = 0;
+        error_ = nullptr;
+        ++generation_;
+
+        cv_.notify_all();
+
+        work(lock);
+        done_cv_.wait(lock, [&] { return finished_ == tasks_; });
+
+        task_ = nullptr;
+        tasks_ = 0;
+
+        if (error_)
+        {
+            std::exception_ptr error = error_;
+            error_ = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+#endif
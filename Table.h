@@ -0,0 +1,1666 @@
+#ifndef TABLE_H
+#define TABLE_H
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+struct Record
+{
+    int32_t id;
+    char title[64];
+    double price;
+    int32_t quantity;
+    bool is_deleted;
+};
+
+struct Header
+{
+    uint32_t magic;
+    int32_t capacity;
+    int32_t count;
+    int32_t hash;
+    int32_t clean;
+};
+
+constexpr int32_t kRecordSize = sizeof(Record);
+constexpr int32_t kHeaderSize = sizeof(Header);
+constexpr uint32_t kMagic = 0x33424450;
+
+// Files from before the bucketed layout have no magic: just this header
+// followed by capacity flat slots, id == 0 marking a never-used one.
+struct LegacyHeader
+{
+    int32_t capacity;
+    int32_t count;
+};
+
+constexpr int32_t kLegacyBlockSlots = 4096;
+
+// The file is a header page followed by page-sized buckets. A bucket
+// starts with one control byte per slot; Table keeps a copy of all of
+// them in memory, so probing only touches the file for candidate slots.
+constexpr int32_t kPageSize = 4096;
+constexpr int32_t kBucketSlots = 46;
+constexpr int32_t kCtrlStride = 48;
+
+constexpr uint8_t kCtrlEmpty = 0x00;
+constexpr uint8_t kCtrlDeleted = 0x01;
+constexpr uint8_t kCtrlSentinel = 0x7F;
+
+constexpr uint64_t kSlotMask = (uint64_t(1) << kBucketSlots) - 1;
+
+struct Bucket
+{
+    uint8_t ctrl[kCtrlStride];
+    Record slots[kBucketSlots];
+};
+
+static_assert(sizeof(Bucket) == kPageSize, "Bucket must fill exactly one page");
+static_assert(kCtrlStride % 16 == 0 && kCtrlStride >= kBucketSlots, "Control bytes are matched 16 at a time");
+
+inline bool isFull(const uint8_t ctrl)
+{
+    return (ctrl & 0x80) != 0;
+}
+
+// Bit i is set when ctrl[i] == value, for the kCtrlStride control bytes
+// of one bucket.
+inline uint64_t matchCtrl(const uint8_t* ctrl, const uint8_t value)
+{
+    uint64_t mask = 0;
+
+#ifdef __SSE2__
+    const __m128i needle = _mm_set1_epi8(static_cast<char>(value));
+
+    for (int32_t group = 0; group < kCtrlStride; group += 16)
+    {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl + group));
+        const uint32_t bits = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, needle));
+
+        mask |= static_cast<uint64_t>(bits) << group;
+    }
+#else
+    for (int32_t idx = 0; idx < kCtrlStride; ++idx)
+    {
+        mask |= static_cast<uint64_t>(ctrl[idx] == value) << idx;
+    }
+#endif
+
+    return mask & kSlotMask;
+}
+
+// Bit i is set when slot i holds a live record.
+inline uint64_t matchFull(const uint8_t* ctrl)
+{
+    uint64_t mask = 0;
+
+#ifdef __SSE2__
+    for (int32_t group = 0; group < kCtrlStride; group += 16)
+    {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl + group));
+        const uint32_t bits = _mm_movemask_epi8(bytes);
+
+        mask |= static_cast<uint64_t>(bits) << group;
+    }
+#else
+    for (int32_t idx = 0; idx < kCtrlStride; ++idx)
+    {
+        mask |= static_cast<uint64_t>(isFull(ctrl[idx])) << idx;
+    }
+#endif
+
+    return mask & kSlotMask;
+}
+
+inline int32_t lowestBit(const uint64_t mask)
+{
+    return __builtin_ctzll(mask);
+}
+
+// memcpy made of relaxed atomic loads and stores, a word at a time where
+// both ends are equally aligned. Lock-free lookups read the mapping while
+// writers store to it; with plain copies that would be a data race.
+inline void relaxedCopy(void* dest, const void* src, const size_t len)
+{
+    char* d = static_cast<char*>(dest);
+    const char* s = static_cast<const char*>(src);
+    size_t i = 0;
+
+    if (reinterpret_cast<uintptr_t>(d) % 8 == reinterpret_cast<uintptr_t>(s) % 8)
+    {
+        for (; i < len && reinterpret_cast<uintptr_t>(d + i) % 8 != 0; ++i)
+        {
+            __atomic_store_n(d + i, __atomic_load_n(s + i, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        }
+
+        for (; i + 8 <= len; i += 8)
+        {
+            __atomic_store_n(reinterpret_cast<uint64_t*>(d + i),
+                             __atomic_load_n(reinterpret_cast<const uint64_t*>(s + i), __ATOMIC_RELAXED),
+                             __ATOMIC_RELAXED);
+        }
+    }
+
+    for (; i < len; ++i)
+    {
+        __atomic_store_n(d + i, __atomic_load_n(s + i, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    }
+}
+
+constexpr int32_t kMaxDistance = 255;
+
+// Full scans read this many buckets (2 MiB) per call.
+constexpr int32_t kStreamChunkBuckets = 512;
+
+// Returned by Table::tryFind() when a writer changed a bucket under it.
+constexpr int32_t kRetry = -2;
+
+// Buckets an optimistic lookup looked at, with their sequence numbers.
+struct SeqSnapshot
+{
+    int32_t n = 0;
+    std::pair<int32_t, uint32_t> seen[kMaxDistance + 1];
+};
+
+enum class Backend { PREAD, MMAP };
+
+// 64-bit finalizers used to spread ids over the table. The kind is
+// stored in the file header, so a file is always probed with the hash
+// it was built with.
+enum class HashKind : int32_t { MURMUR = 0, XXHASH = 1 };
+
+using HashFn = uint64_t (*)(uint64_t);
+
+// Pages read while placing one insert batch, so that every bucket the
+// batch probes is read from the file at most once.
+using PageCache = std::unordered_map<int32_t, Bucket>;
+
+inline uint64_t murmurMix(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+inline uint64_t xxhashMix(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xC2B2AE3D27D4EB4FULL;
+    key ^= key >> 29;
+    key *= 0x165667B19E3779F9ULL;
+    key ^= key >> 32;
+    return key;
+}
+
+inline HashFn hashFunction(const HashKind kind)
+{
+    switch (kind)
+    {
+        case HashKind::MURMUR:
+            return murmurMix;
+        case HashKind::XXHASH:
+            return xxhashMix;
+    }
+    throw std::runtime_error("Unknown hash function in db file");
+}
+
+enum class SyncMode { NONE, ASYNC, SYNC };
+
+enum class InsertStatus { OK, DUPLICATE, FULL };
+
+// Distances in buckets, and in slots: how many slots lie between the
+// first slot of the record's home bucket and the record itself.
+struct ProbeStats
+{
+    int32_t live = 0;
+    int32_t max_distance = 0;
+    int64_t total_distance = 0;
+    int32_t max_slots = 0;
+    int64_t total_slots = 0;
+    std::vector<int64_t> histogram;
+};
+
+// One open-addressing hash table stored in its own file, probed bucket
+// by bucket with Robin Hood placement: a record's distance is how many
+// buckets past its home bucket it sits, and an insert that reaches a
+// full bucket takes the slot of the resident closest to home if that
+// one is closer than itself. Deletes shift the farthest record of the
+// next bucket back into the hole, so there are no tombstones.
+//
+// Control bytes are kCtrlEmpty (a fresh file is all zeroes) or 0x80 | 7
+// bits of the key hash; padding bytes past kBucketSlots hold
+// kCtrlSentinel. A table being drained by a resize is frozen instead:
+// deletes leave kCtrlDeleted so records never move behind the cursor.
+class Table
+{
+private:
+    string path_;
+    Backend backend_;
+    SyncMode sync_;
+    HashKind hash_kind_;
+    HashFn hash_;
+    int fd_ = -1;
+    char* map_ = nullptr;
+    size_t map_size_ = 0;
+    int32_t buckets_ = 0;
+    // Point writes on disjoint bucket ranges may run concurrently (see
+    // Database), so the shared counters are atomic.
+    std::atomic<int32_t> count_{0};
+    std::atomic<bool> header_clean_{false};
+    std::mutex header_mutex_;
+    bool draining_ = false;
+    std::vector<uint8_t> ctrl_;
+    std::vector<uint8_t> dist_;
+
+    // Shadow copies of each slot's price and quantity, indexed by slot, so
+    // numeric scans only read pages that hold a match. Together with the
+    // control bytes as the live bitmap that is 13 bytes per slot.
+    std::vector<double> prices_;
+    std::vector<int32_t> quantities_;
+
+    // Seqlock per bucket for lookups that take no lock: odd while a writer
+    // is changing the bucket's metadata or records.
+    std::unique_ptr<std::atomic<uint32_t>[]> seq_;
+
+    // Called with the buckets a write is about to change, before any of
+    // them changes on disk; each bucket is passed once until forgetSaved().
+    // Database keeps their before-images this way (see PageJournal). Like
+    // the buckets themselves, each saved_ byte belongs to whoever holds
+    // the bucket.
+    std::function<void(const Table&, const std::vector<int32_t>&)> before_write_;
+    std::vector<uint8_t> saved_;
+
+    static off_t bucketOffset(const int32_t bucket)
+    {
+        return static_cast<off_t>(bucket + 1) * kPageSize;
+    }
+
+    static off_t slotOffset(const int32_t slot)
+    {
+        return bucketOffset(slot / kBucketSlots) + offsetof(Bucket, slots) +
+               static_cast<off_t>(slot % kBucketSlots) * kRecordSize;
+    }
+
+    static off_t ctrlOffset(const int32_t slot)
+    {
+        return bucketOffset(slot / kBucketSlots) + slot % kBucketSlots;
+    }
+
+    // The low bits of the hash pick the bucket (buckets_ is a power of
+    // two), the top 7 bits become the control byte.
+    uint8_t fingerprint(const int32_t id) const
+    {
+        return 0x80 | (hash_(static_cast<uint32_t>(id)) >> 57);
+    }
+
+    int32_t homeBucket(const int32_t id) const
+    {
+        if (buckets_ == 0)
+        {
+            throw std::runtime_error("DB doesn't exist");
+        }
+        return hash_(static_cast<uint32_t>(id)) & (buckets_ - 1);
+    }
+
+    const uint8_t* ctrlOf(const int32_t bucket) const
+    {
+        return ctrl_.data() + static_cast<size_t>(bucket) * kCtrlStride;
+    }
+
+    uint8_t* ctrlOf(const int32_t bucket)
+    {
+        return ctrl_.data() + static_cast<size_t>(bucket) * kCtrlStride;
+    }
+
+    const uint8_t* distOf(const int32_t bucket) const
+    {
+        return dist_.data() + static_cast<size_t>(bucket) * kCtrlStride;
+    }
+
+    uint8_t* distOf(const int32_t bucket)
+    {
+        return dist_.data() + static_cast<size_t>(bucket) * kCtrlStride;
+    }
+
+    // A bucket's control and distance bytes as a lock-free lookup sees
+    // them: copied out with relaxed atomic loads, since writers may be
+    // storing to them meanwhile (always through setMeta).
+    struct BucketMeta
+    {
+        alignas(16) uint8_t ctrl[kCtrlStride];
+        uint8_t dist[kCtrlStride];
+    };
+
+    void loadMeta(const int32_t bucket, BucketMeta& meta) const
+    {
+        const uint8_t* ctrl = ctrlOf(bucket);
+        const uint8_t* dist = distOf(bucket);
+
+        for (int32_t idx = 0; idx < kCtrlStride; ++idx)
+        {
+            meta.ctrl[idx] = __atomic_load_n(ctrl + idx, __ATOMIC_RELAXED);
+            meta.dist[idx] = __atomic_load_n(dist + idx, __ATOMIC_RELAXED);
+        }
+    }
+
+    static void setMeta(uint8_t& byte, const uint8_t value)
+    {
+        __atomic_store_n(&byte, value, __ATOMIC_RELAXED);
+    }
+
+    // Slot of the live record in bucket that is closest to (for
+    // nearest == true) or farthest from its home bucket, -1 if none.
+    int32_t extremeDistance(const int32_t bucket, const bool nearest) const
+    {
+        return extremeDistance(ctrlOf(bucket), distOf(bucket), nearest);
+    }
+
+    static int32_t extremeDistance(const uint8_t* ctrl, const uint8_t* dist, const bool nearest)
+    {
+        int32_t best = -1;
+
+        for (uint64_t live = matchFull(ctrl); live != 0; live &= live - 1)
+        {
+            const int32_t idx = lowestBit(live);
+
+            if (best < 0 || (nearest ? dist[idx] < dist[best] : dist[idx] > dist[best]))
+            {
+                best = idx;
+            }
+        }
+
+        return best;
+    }
+
+    int32_t next(const int32_t bucket) const
+    {
+        return (bucket + 1) & (buckets_ - 1);
+    }
+
+    void shadow(const int32_t slot, const Record& record)
+    {
+        prices_[slot] = record.price;
+        quantities_[slot] = record.quantity;
+    }
+
+    void resetCtrl()
+    {
+        ctrl_.assign(static_cast<size_t>(buckets_) * kCtrlStride, kCtrlEmpty);
+        dist_.assign(static_cast<size_t>(buckets_) * kCtrlStride, 0);
+        prices_.assign(static_cast<size_t>(buckets_) * kBucketSlots, 0.0);
+        quantities_.assign(static_cast<size_t>(buckets_) * kBucketSlots, 0);
+        seq_.reset(new std::atomic<uint32_t>[buckets_]());
+        saved_.assign(buckets_, 0);
+
+        for (int32_t b = 0; b < buckets_; ++b)
+        {
+            std::fill(ctrlOf(b) + kBucketSlots, ctrlOf(b) + kCtrlStride, kCtrlSentinel);
+        }
+    }
+
+    // Returns the number of live records found.
+    int32_t loadCtrl()
+    {
+        resetCtrl();
+
+        int32_t live_count = 0;
+
+        BucketStream stream(*this, 0, buckets_);
+
+        while (stream.next())
+        {
+            const Bucket* chunk = stream.read();
+
+            for (int32_t b = 0; b < stream.size(); ++b)
+            {
+                const int32_t bucket = stream.first() + b;
+                std::copy(chunk[b].ctrl, chunk[b].ctrl + kBucketSlots, ctrlOf(bucket));
+
+                for (uint64_t live = matchFull(ctrlOf(bucket)); live != 0; live &= live - 1)
+                {
+                    const int32_t idx = lowestBit(live);
+                    const int32_t home = homeBucket(chunk[b].slots[idx].id);
+
+                    distOf(bucket)[idx] = (bucket - home) & (buckets_ - 1);
+                    shadow(bucket * kBucketSlots + idx, chunk[b].slots[idx]);
+                    ++live_count;
+                }
+            }
+        }
+
+        return live_count;
+    }
+
+    void openFile(const int flags)
+    {
+        close();
+
+        fd_ = ::open(path_.c_str(), O_RDWR | flags, 0644);
+
+        if (fd_ < 0)
+        {
+            throw std::runtime_error("File for db didn't open");
+        }
+    }
+
+    void mapFile()
+    {
+        unmapFile();
+
+        if (backend_ != Backend::MMAP || buckets_ == 0)
+        {
+            return;
+        }
+
+        const size_t size = bucketOffset(buckets_);
+        void* ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+
+        if (ptr == MAP_FAILED)
+        {
+            throw std::runtime_error("Couldn't mmap db file");
+        }
+
+        map_ = static_cast<char*>(ptr);
+        map_size_ = size;
+    }
+
+    void unmapFile()
+    {
+        if (map_ != nullptr)
+        {
+            ::munmap(map_, map_size_);
+            map_ = nullptr;
+            map_size_ = 0;
+        }
+    }
+
+    void syncRange(const off_t offset, const size_t len) const
+    {
+        if (sync_ == SyncMode::NONE)
+        {
+            return;
+        }
+
+        if (map_ == nullptr)
+        {
+            if (sync_ == SyncMode::SYNC)
+            {
+                ::fdatasync(fd_);
+            }
+            return;
+        }
+
+        static const off_t page = ::sysconf(_SC_PAGESIZE);
+        const off_t begin = offset - offset % page;
+
+        ::msync(map_ + begin, offset + len - begin, sync_ == SyncMode::SYNC ? MS_SYNC : MS_ASYNC);
+    }
+
+    void readAt(const off_t offset, void* buf, const size_t len) const
+    {
+        if (fd_ < 0)
+        {
+            throw std::runtime_error("DB doesn't exist");
+        }
+
+        if (map_ != nullptr)
+        {
+            relaxedCopy(buf, map_ + offset, len);
+            return;
+        }
+
+        char* ptr = static_cast<char*>(buf);
+        size_t done = 0;
+
+        while (done < len)
+        {
+            const ssize_t n = ::pread(fd_, ptr + done, len - done, offset + done);
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                throw std::runtime_error("Couldn't read from db file");
+            }
+            done += n;
+        }
+    }
+
+    void writeAt(const off_t offset, const void* buf, const size_t len) const
+    {
+        if (fd_ < 0)
+        {
+            throw std::runtime_error("DB doesn't exist");
+        }
+
+        if (map_ != nullptr)
+        {
+            relaxedCopy(map_ + offset, buf, len);
+            syncRange(offset, len);
+            return;
+        }
+
+        const char* ptr = static_cast<const char*>(buf);
+        size_t done = 0;
+
+        while (done < len)
+        {
+            const ssize_t n = ::pwrite(fd_, ptr + done, len - done, offset + done);
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                throw std::runtime_error("Couldn't write to db file");
+            }
+            done += n;
+        }
+
+        syncRange(offset, len);
+    }
+
+    void writeHeader(const bool clean)
+    {
+        Header header{kMagic, capacity(), count_, static_cast<int32_t>(hash_kind_), clean};
+        writeAt(0, &header, kHeaderSize);
+        header_clean_ = clean;
+    }
+
+    // The count in the header is only kept up to date by flushHeader().
+    // Before the first change after a flush the header is marked unclean,
+    // so after a crash open() knows to recount instead of trusting it.
+    void markDirty()
+    {
+        if (!header_clean_)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(header_mutex_);
+
+        if (header_clean_)
+        {
+            writeHeader(false);
+        }
+    }
+
+    // Reads the record in slot, preferring a not yet written copy from
+    // the write buffer. With pages given, the whole bucket is read once
+    // and kept there; the mapping needs no such cache.
+    const Record& candidate(const int32_t slot, const std::map<int32_t, Record>* pending, Record& buf,
+                            PageCache* pages = nullptr) const
+    {
+        if (pending != nullptr)
+        {
+            const auto it = pending->find(slot);
+
+            if (it != pending->end())
+            {
+                return it->second;
+            }
+        }
+
+        if (pages != nullptr && map_ == nullptr)
+        {
+            const int32_t b = slot / kBucketSlots;
+            auto it = pages->find(b);
+
+            if (it == pages->end())
+            {
+                it = pages->emplace(b, Bucket()).first;
+                readBuckets(b, 1, &it->second);
+            }
+
+            return it->second.slots[slot % kBucketSlots];
+        }
+
+        readRecord(slot, buf);
+        return buf;
+    }
+
+    // Writers of a bucket are serialized by the caller, so an odd count
+    // can only mean this writer already started on it.
+    void beginWrite(const int32_t bucket, std::vector<int32_t>& dirty) const
+    {
+        std::atomic<uint32_t>& seq = seq_[bucket];
+        const uint32_t value = seq.load(std::memory_order_relaxed);
+
+        if (value & 1)
+        {
+            return;
+        }
+
+        seq.store(value + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        dirty.push_back(bucket);
+    }
+
+    void endWrites(const std::vector<int32_t>& dirty) const
+    {
+        for (const int32_t b : dirty)
+        {
+            seq_[b].store(seq_[b].load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+    }
+
+    // With seen set, every bucket's sequence number is recorded before it
+    // is read and kRetry is returned if one is mid-write.
+    int32_t lookup(const int32_t id, int& disk_reads, Record* out,
+                   const std::map<int32_t, Record>* pending = nullptr, SeqSnapshot* seen = nullptr,
+                   PageCache* pages = nullptr) const
+    {
+        const uint8_t fp = fingerprint(id);
+        int32_t b = homeBucket(id);
+
+        for (int32_t distance = 0; distance < buckets_ && distance <= kMaxDistance; ++distance)
+        {
+            if (seen != nullptr)
+            {
+                const uint32_t seq = seq_[b].load(std::memory_order_acquire);
+
+                if (seq & 1)
+                {
+                    return kRetry;
+                }
+                seen->seen[seen->n++] = {b, seq};
+            }
+
+            BucketMeta meta;
+            loadMeta(b, meta);
+
+            for (uint64_t match = matchCtrl(meta.ctrl, fp); match != 0; match &= match - 1)
+            {
+                const int32_t slot = b * kBucketSlots + lowestBit(match);
+
+                Record buf;
+                const Record& record = candidate(slot, pending, buf, pages);
+                ++disk_reads;
+
+                if (record.id == id)
+                {
+                    if (out != nullptr)
+                    {
+                        *out = record;
+                    }
+                    return slot;
+                }
+            }
+
+            if (matchCtrl(meta.ctrl, kCtrlEmpty) != 0)
+            {
+                return -1;
+            }
+
+            // Had the key reached this bucket, it would have displaced
+            // any resident closer to home than itself.
+            const int32_t nearest = extremeDistance(meta.ctrl, meta.dist, true);
+
+            if (nearest >= 0 && meta.dist[nearest] < distance)
+            {
+                return -1;
+            }
+
+            b = next(b);
+        }
+
+        return -1;
+    }
+
+    // Follows the chain of displacements an insert of id would cause,
+    // using only the in-memory metadata, so a table that turns out to be
+    // full is detected before anything is moved.
+    bool fits(const int32_t id) const
+    {
+        int32_t b = homeBucket(id);
+        int32_t distance = 0;
+
+        for (int32_t step = 0; step < buckets_; ++step)
+        {
+            if (matchCtrl(ctrlOf(b), kCtrlEmpty) != 0)
+            {
+                return true;
+            }
+
+            const int32_t nearest = extremeDistance(b, true);
+
+            if (nearest >= 0 && distOf(b)[nearest] < distance)
+            {
+                distance = distOf(b)[nearest];
+            }
+
+            b = next(b);
+
+            if (++distance > kMaxDistance)
+            {
+                return false;
+            }
+        }
+
+        return false;
+    }
+
+    // Robin Hood insert into the in-memory metadata; the moved records
+    // land in pending, touched buckets in dirty. Their sequence counters
+    // stay odd until the caller's endWrites(). Records evicted to another
+    // slot are also appended to moved, if given.
+    InsertStatus place(Record record, std::map<int32_t, Record>& pending, std::vector<int32_t>& dirty,
+                       std::vector<Record>* moved = nullptr, PageCache* pages = nullptr)
+    {
+        int disk_reads = 0;
+
+        if (lookup(record.id, disk_reads, nullptr, &pending, nullptr, pages) >= 0)
+        {
+            return InsertStatus::DUPLICATE;
+        }
+
+        if (draining_ || !fits(record.id))
+        {
+            return InsertStatus::FULL;
+        }
+
+        record.is_deleted = false;
+
+        uint8_t fp = fingerprint(record.id);
+        uint8_t distance = 0;
+        int32_t b = homeBucket(record.id);
+
+        while (true)
+        {
+            uint8_t* ctrl = ctrlOf(b);
+            uint8_t* dist = distOf(b);
+            const uint64_t empty = matchCtrl(ctrl, kCtrlEmpty);
+
+            if (empty != 0)
+            {
+                const int32_t idx = lowestBit(empty);
+
+                beginWrite(b, dirty);
+                setMeta(ctrl[idx], fp);
+                setMeta(dist[idx], distance);
+                pending[b * kBucketSlots + idx] = record;
+
+                return InsertStatus::OK;
+            }
+
+            const int32_t idx = extremeDistance(b, true);
+
+            if (idx >= 0 && dist[idx] < distance)
+            {
+                const int32_t slot = b * kBucketSlots + idx;
+
+                Record buf;
+                const Record evicted = candidate(slot, &pending, buf, pages);
+
+                beginWrite(b, dirty);
+                pending[slot] = record;
+
+                const uint8_t evicted_fp = ctrl[idx];
+                const uint8_t evicted_distance = dist[idx];
+                setMeta(ctrl[idx], fp);
+                setMeta(dist[idx], distance);
+                fp = evicted_fp;
+                distance = evicted_distance;
+
+                record = evicted;
+
+                if (moved != nullptr)
+                {
+                    moved->push_back(evicted);
+                }
+            }
+
+            b = next(b);
+            ++distance;
+        }
+    }
+
+    void saveImages(const std::vector<int32_t>& buckets)
+    {
+        if (!before_write_)
+        {
+            return;
+        }
+
+        std::vector<int32_t> unsaved;
+
+        for (const int32_t b : buckets)
+        {
+            if (!saved_[b])
+            {
+                unsaved.push_back(b);
+            }
+        }
+
+        if (unsaved.empty())
+        {
+            return;
+        }
+
+        before_write_(*this, unsaved);
+
+        for (const int32_t b : unsaved)
+        {
+            saved_[b] = 1;
+        }
+    }
+
+    // Writes buffered records, one pwrite per run of neighbouring slots,
+    // then the control bytes of every touched bucket. Not atomic: cut
+    // short, it leaves control bytes and slots that don't agree, which is
+    // why the old pages are saved first.
+    void writeBack(const std::map<int32_t, Record>& pending, const std::vector<int32_t>& dirty)
+    {
+        saveImages(dirty);
+
+        std::vector<Record> run;
+
+        for (auto it = pending.begin(); it != pending.end();)
+        {
+            const int32_t first = it->first;
+            run.clear();
+
+            while (it != pending.end() && it->first == first + static_cast<int32_t>(run.size()) &&
+                   (run.empty() || it->first % kBucketSlots != 0))
+            {
+                shadow(it->first, it->second);
+                run.push_back(it->second);
+                ++it;
+            }
+
+            writeAt(slotOffset(first), run.data(), run.size() * kRecordSize);
+        }
+
+        for (const int32_t b : dirty)
+        {
+            writeAt(bucketOffset(b), ctrlOf(b), kBucketSlots);
+        }
+    }
+
+public:
+    Table(string path, const Backend backend, const SyncMode sync, const HashKind hash_kind)
+        : path_(std::move(path)), backend_(backend), sync_(sync),
+          hash_kind_(hash_kind), hash_(hashFunction(hash_kind))
+    {
+    }
+
+    ~Table()
+    {
+        close();
+    }
+
+    Table(const Table&) = delete;
+    Table& operator=(const Table&) = delete;
+
+    const string& path() const
+    {
+        return path_;
+    }
+
+    bool isOpen() const
+    {
+        return fd_ >= 0;
+    }
+
+    int32_t buckets() const
+    {
+        return buckets_;
+    }
+
+    int32_t capacity() const
+    {
+        return buckets_ * kBucketSlots;
+    }
+
+    int32_t count() const
+    {
+        return count_;
+    }
+
+    // A point operation on id only touches buckets from homeOf(id) up to
+    // the first one with room, plus the next one for a backward shift.
+    int32_t homeOf(const int32_t id) const
+    {
+        return homeBucket(id);
+    }
+
+    bool hasRoom(const int32_t bucket) const
+    {
+        return matchCtrl(ctrlOf(bucket), kCtrlEmpty) != 0;
+    }
+
+    void create(const int32_t capacity)
+    {
+        openFile(O_CREAT | O_TRUNC);
+
+        int32_t buckets = 1;
+
+        while (buckets * kBucketSlots < capacity)
+        {
+            buckets <<= 1;
+        }
+
+        if (::ftruncate(fd_, bucketOffset(buckets)) != 0)
+        {
+            throw std::runtime_error("Couldn't allocate db file");
+        }
+
+        buckets_ = buckets;
+        count_ = 0;
+        resetCtrl();
+        mapFile();
+        writeHeader(true);
+    }
+
+    // True if path holds a table in the flat pre-bucket layout: a file
+    // whose size is exactly what the capacity in its header implies.
+    static bool isLegacyFile(const string& path, LegacyHeader& header)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat st{};
+        const bool legacy = ::pread(fd, &header, sizeof(header), 0) == sizeof(header) && ::fstat(fd, &st) == 0 &&
+                            header.capacity > 0 &&
+                            st.st_size == static_cast<off_t>(sizeof(header)) +
+                                           static_cast<off_t>(header.capacity) * kRecordSize;
+
+        ::close(fd);
+        return legacy;
+    }
+
+    // Reads a flat-layout file front to back and calls f with its live
+    // records, kLegacyBlockSlots slots at a time.
+    template <class F>
+    static void readLegacyFile(const string& path, F f)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+
+        if (fd < 0)
+        {
+            throw std::runtime_error("Couldn't open old db file");
+        }
+
+        LegacyHeader header{};
+        std::vector<Record> block(kLegacyBlockSlots);
+        std::vector<Record> live;
+
+        auto readFully = [fd](const off_t offset, void* buf, const size_t len)
+        {
+            char* ptr = static_cast<char*>(buf);
+            size_t done = 0;
+
+            while (done < len)
+            {
+                const ssize_t n = ::pread(fd, ptr + done, len - done, offset + done);
+
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n <= 0)
+                {
+                    return false;
+                }
+                done += n;
+            }
+            return true;
+        };
+
+        bool ok = readFully(0, &header, sizeof(header));
+
+        for (int32_t first = 0; ok && first < header.capacity; first += kLegacyBlockSlots)
+        {
+            const int32_t n = std::min(kLegacyBlockSlots, header.capacity - first);
+            ok = readFully(static_cast<off_t>(sizeof(header)) + static_cast<off_t>(first) * kRecordSize,
+                           block.data(), static_cast<size_t>(n) * kRecordSize);
+
+            live.clear();
+
+            for (int32_t i = 0; ok && i < n; ++i)
+            {
+                if (block[i].id != 0 && !block[i].is_deleted)
+                {
+                    live.push_back(block[i]);
+                }
+            }
+
+            if (ok && !live.empty())
+            {
+                try
+                {
+                    f(live);
+                }
+                catch (...)
+                {
+                    ::close(fd);
+                    throw;
+                }
+            }
+        }
+
+        ::close(fd);
+
+        if (!ok)
+        {
+            throw std::runtime_error("Couldn't read old db file");
+        }
+    }
+
+    void open()
+    {
+        openFile(0);
+
+        Header header;
+        readAt(0, &header, kHeaderSize);
+
+        if (header.magic != kMagic)
+        {
+            close();
+            throw std::runtime_error("Unsupported db file format");
+        }
+
+        buckets_ = header.capacity / kBucketSlots;
+        count_ = header.count;
+        hash_kind_ = static_cast<HashKind>(header.hash);
+        hash_ = hashFunction(hash_kind_);
+
+        if (buckets_ <= 0 || (buckets_ & (buckets_ - 1)) != 0)
+        {
+            close();
+            throw std::runtime_error("Corrupted db header");
+        }
+
+        mapFile();
+        const int32_t live_count = loadCtrl();
+
+        header_clean_ = header.clean != 0;
+
+        if (!header_clean_)
+        {
+            std::cerr << path_ << " wasn't closed cleanly, recounting records" << std::endl;
+            count_ = live_count;
+        }
+    }
+
+    void close()
+    {
+        if (fd_ >= 0)
+        {
+            flushHeader();
+        }
+
+        unmapFile();
+
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        buckets_ = 0;
+        count_ = 0;
+        header_clean_ = false;
+        draining_ = false;
+        ctrl_.clear();
+        ctrl_.shrink_to_fit();
+        dist_.clear();
+        dist_.shrink_to_fit();
+        prices_.clear();
+        prices_.shrink_to_fit();
+        quantities_.clear();
+        quantities_.shrink_to_fit();
+        seq_.reset();
+        saved_.clear();
+        saved_.shrink_to_fit();
+    }
+
+    void setBeforeWrite(std::function<void(const Table&, const std::vector<int32_t>&)> f)
+    {
+        before_write_ = std::move(f);
+    }
+
+    // The saved pages were dropped, the next write of any bucket has to
+    // save it again.
+    void forgetSaved()
+    {
+        std::fill(saved_.begin(), saved_.end(), 0);
+    }
+
+    void renameTo(const string& path)
+    {
+        if (::rename(path_.c_str(), path.c_str()) != 0)
+        {
+            throw std::runtime_error("Couldn't rename db file");
+        }
+        path_ = path;
+    }
+
+    void flushHeader()
+    {
+        if (!header_clean_)
+        {
+            writeHeader(true);
+        }
+    }
+
+    void readBuckets(const int32_t first, const int32_t n, Bucket* buckets) const
+    {
+        readAt(bucketOffset(first), buckets, static_cast<size_t>(n) * kPageSize);
+    }
+
+    void writeBuckets(const int32_t first, const int32_t n, const Bucket* buckets) const
+    {
+        writeAt(bucketOffset(first), buckets, static_cast<size_t>(n) * kPageSize);
+    }
+
+    // Points at n buckets starting at first: straight into the mapping,
+    // or into buf after one read.
+    const Bucket* peekBuckets(const int32_t first, const int32_t n, std::vector<Bucket>& buf) const
+    {
+        if (map_ != nullptr)
+        {
+            return reinterpret_cast<const Bucket*>(map_ + bucketOffset(first));
+        }
+
+        buf.resize(n);
+        readBuckets(first, n, buf.data());
+        return buf.data();
+    }
+
+    void readRecord(const int32_t slot, Record& record) const
+    {
+        readAt(slotOffset(slot), &record, kRecordSize);
+    }
+
+    void writeRecord(const int32_t slot, const Record& record)
+    {
+        std::vector<int32_t> dirty;
+
+        saveImages({slot / kBucketSlots});
+        beginWrite(slot / kBucketSlots, dirty);
+        shadow(slot, record);
+        writeAt(slotOffset(slot), &record, kRecordSize);
+        endWrites(dirty);
+    }
+
+    // Passes a hint about how the n buckets from first will be read on
+    // to the kernel: one of the POSIX_FADV_* values, which are mapped to
+    // their MADV_* counterparts for the mmap backend.
+    void advise(const int32_t first, const int32_t n, const int advice) const
+    {
+        if (n <= 0)
+        {
+            return;
+        }
+
+        const size_t len = static_cast<size_t>(n) * kPageSize;
+
+        if (map_ != nullptr)
+        {
+            ::madvise(map_ + bucketOffset(first), len, advice == POSIX_FADV_WILLNEED ? MADV_WILLNEED : MADV_SEQUENTIAL);
+        }
+        else if (fd_ >= 0)
+        {
+            ::posix_fadvise(fd_, bucketOffset(first), len, advice);
+        }
+    }
+
+    // Reads the n buckets from first front to back, chunk_buckets at a
+    // time: one pread per chunk, or straight from the mapping. The range
+    // is announced as sequential, and reading a chunk asks the kernel to
+    // start fetching the next one meanwhile. next() only moves on; the
+    // caller decides when (under which locks) read() touches the file.
+    class BucketStream
+    {
+    private:
+        const Table& table_;
+        int32_t end_;
+        int32_t chunk_buckets_;
+        int32_t first_;
+        int32_t n_ = 0;
+        std::vector<Bucket> buf_;
+
+    public:
+        BucketStream(const Table& table, const int32_t first, const int32_t n,
+                     const int32_t chunk_buckets = kStreamChunkBuckets)
+            : table_(table), end_(first + n), chunk_buckets_(chunk_buckets), first_(first)
+        {
+            table_.advise(first, n, POSIX_FADV_SEQUENTIAL);
+        }
+
+        bool next()
+        {
+            first_ += n_;
+            n_ = std::min(chunk_buckets_, end_ - first_);
+            return n_ > 0;
+        }
+
+        int32_t first() const
+        {
+            return first_;
+        }
+
+        int32_t size() const
+        {
+            return n_;
+        }
+
+        const Bucket* read()
+        {
+            const Bucket* chunk = table_.peekBuckets(first_, n_, buf_);
+
+            const int32_t ahead = first_ + n_;
+            table_.advise(ahead, std::min(chunk_buckets_, end_ - ahead), POSIX_FADV_WILLNEED);
+
+            return chunk;
+        }
+    };
+
+    // Calls f(slot, record) for every live record.
+    template <class F>
+    void forEachLive(F f) const
+    {
+        forEachLiveIn(0, buckets_, f);
+    }
+
+    // Same, restricted to the n buckets starting at first.
+    template <class F>
+    void forEachLiveIn(const int32_t first_bucket, const int32_t n_buckets, F f) const
+    {
+        forEachMatchIn(first_bucket, n_buckets, [](const Record*) { return kSlotMask; }, f);
+    }
+
+    // Like forEachLiveIn, but only for the live slots whose bit is set in
+    // select(bucket.slots), which sees a whole bucket at a time.
+    template <class S, class F>
+    void forEachMatchIn(const int32_t first_bucket, const int32_t n_buckets, S select, F f) const
+    {
+        BucketStream stream(*this, first_bucket, n_buckets);
+
+        while (stream.next())
+        {
+            forEachMatch(stream, select, f);
+        }
+    }
+
+    // The same for the current chunk of stream, which it reads.
+    template <class S, class F>
+    void forEachMatch(BucketStream& stream, S select, F f) const
+    {
+        const Bucket* chunk = stream.read();
+
+        for (int32_t b = 0; b < stream.size(); ++b)
+        {
+            const int32_t bucket = stream.first() + b;
+            const uint64_t live = matchFull(ctrlOf(bucket));
+
+            if (live == 0)
+            {
+                continue;
+            }
+
+            for (uint64_t hit = live & select(chunk[b].slots); hit != 0; hit &= hit - 1)
+            {
+                const int32_t idx = lowestBit(hit);
+                f(bucket * kBucketSlots + idx, chunk[b].slots[idx]);
+            }
+        }
+    }
+
+    // Like forEachMatchIn, but select(prices, quantities) gets the shadow
+    // columns of a bucket instead of its records. Pages without a match
+    // aren't read at all, and with only a few matches just those records
+    // are.
+    template <class S, class F>
+    void forEachColumnMatchIn(const int32_t first_bucket, const int32_t n_buckets, S select, F f) const
+    {
+        constexpr int32_t kSparseHits = 4;
+
+        std::vector<Bucket> buf;
+        Record record;
+
+        for (int32_t b = first_bucket; b < first_bucket + n_buckets; ++b)
+        {
+            const uint64_t live = matchFull(ctrlOf(b));
+
+            if (live == 0)
+            {
+                continue;
+            }
+
+            const size_t base = static_cast<size_t>(b) * kBucketSlots;
+            uint64_t hit = live & select(prices_.data() + base, quantities_.data() + base);
+
+            if (hit == 0)
+            {
+                continue;
+            }
+
+            if (map_ == nullptr && __builtin_popcountll(hit) <= kSparseHits)
+            {
+                for (; hit != 0; hit &= hit - 1)
+                {
+                    const int32_t slot = b * kBucketSlots + lowestBit(hit);
+
+                    readRecord(slot, record);
+                    f(slot, record);
+                }
+                continue;
+            }
+
+            const Bucket* page = peekBuckets(b, 1, buf);
+
+            for (; hit != 0; hit &= hit - 1)
+            {
+                const int32_t idx = lowestBit(hit);
+                f(b * kBucketSlots + idx, page->slots[idx]);
+            }
+        }
+    }
+
+    // Only slots whose control byte matches the key's fingerprint are
+    // read from the file; disk_reads counts those reads.
+    int32_t find(const int32_t id, int& disk_reads, Record* out = nullptr) const
+    {
+        return lookup(id, disk_reads, out);
+    }
+
+    int32_t find(const int32_t id) const
+    {
+        int disk_reads = 0;
+        return find(id, disk_reads);
+    }
+
+    // find() without any lock: the caller must only make sure the table
+    // itself isn't replaced or resized meanwhile. Returns kRetry if a
+    // concurrent writer touched one of the buckets it read.
+    int32_t tryFind(const int32_t id, int& disk_reads, Record* out) const
+    {
+        SeqSnapshot seen;
+        const int32_t slot = lookup(id, disk_reads, out, nullptr, &seen);
+
+        if (slot == kRetry)
+        {
+            return kRetry;
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        for (int32_t i = 0; i < seen.n; ++i)
+        {
+            if (seq_[seen.seen[i].first].load(std::memory_order_relaxed) != seen.seen[i].second)
+            {
+                return kRetry;
+            }
+        }
+
+        return slot;
+    }
+
+    InsertStatus insert(const Record& record, std::vector<Record>* moved = nullptr)
+    {
+        std::map<int32_t, Record> pending;
+        std::vector<int32_t> dirty;
+
+        const InsertStatus status = place(record, pending, dirty, moved);
+
+        if (status != InsertStatus::OK)
+        {
+            return status;
+        }
+
+        markDirty();
+        writeBack(pending, dirty);
+        endWrites(dirty);
+
+        ++count_;
+
+        return InsertStatus::OK;
+    }
+
+    // Places the whole batch in the write buffer and writes it out once;
+    // the result holds the status of each record. Records that don't fit
+    // are left out, the rest are still written. Probes share one read of
+    // each page, so sorting the batch by home bucket pays off.
+    std::vector<InsertStatus> insertBatch(const std::vector<Record>& records)
+    {
+        std::map<int32_t, Record> pending;
+        std::vector<int32_t> dirty;
+        PageCache pages;
+        std::vector<InsertStatus> statuses;
+        int32_t inserted = 0;
+
+        statuses.reserve(records.size());
+
+        for (const auto& record : records)
+        {
+            statuses.push_back(place(record, pending, dirty, nullptr, &pages));
+
+            if (statuses.back() == InsertStatus::OK)
+            {
+                ++inserted;
+            }
+        }
+
+        if (inserted > 0)
+        {
+            markDirty();
+            writeBack(pending, dirty);
+        }
+        endWrites(dirty);
+
+        count_ += inserted;
+
+        return statuses;
+    }
+
+    // Same for a batch that must fit entirely; duplicates are skipped.
+    int32_t insertMany(const std::vector<Record>& records)
+    {
+        int32_t inserted = 0;
+
+        for (const InsertStatus status : insertBatch(records))
+        {
+            if (status == InsertStatus::FULL)
+            {
+                throw std::runtime_error("No room for batch insert");
+            }
+            if (status == InsertStatus::OK)
+            {
+                ++inserted;
+            }
+        }
+
+        return inserted;
+    }
+
+    // The erased record and every record shifted back are appended to
+    // moved, if given.
+    void erase(const int32_t slot, std::vector<Record>* moved = nullptr)
+    {
+        int32_t b = slot / kBucketSlots;
+        int32_t hole = slot % kBucketSlots;
+
+        std::map<int32_t, Record> pending;
+        std::vector<int32_t> dirty;
+
+        beginWrite(b, dirty);
+
+        if (moved != nullptr)
+        {
+            Record erased;
+            readRecord(slot, erased);
+            moved->push_back(erased);
+        }
+
+        if (draining_)
+        {
+            setMeta(ctrlOf(b)[hole], kCtrlDeleted);
+        }
+        else
+        {
+            setMeta(ctrlOf(b)[hole], kCtrlEmpty);
+            setMeta(distOf(b)[hole], 0);
+
+            // Backward shift: pull the record of the next bucket that is
+            // farthest from home into the hole until nobody wants to move.
+            while (true)
+            {
+                const int32_t nb = next(b);
+                const int32_t idx = extremeDistance(nb, false);
+
+                if (nb == slot / kBucketSlots || idx < 0 || distOf(nb)[idx] == 0)
+                {
+                    break;
+                }
+
+                beginWrite(nb, dirty);
+
+                Record buf;
+                pending[b * kBucketSlots + hole] = candidate(nb * kBucketSlots + idx, &pending, buf);
+
+                if (moved != nullptr)
+                {
+                    moved->push_back(pending[b * kBucketSlots + hole]);
+                }
+
+                setMeta(ctrlOf(b)[hole], ctrlOf(nb)[idx]);
+                setMeta(distOf(b)[hole], distOf(nb)[idx] - 1);
+                setMeta(ctrlOf(nb)[idx], kCtrlEmpty);
+                setMeta(distOf(nb)[idx], 0);
+
+                b = nb;
+                hole = idx;
+            }
+        }
+
+        markDirty();
+        writeBack(pending, dirty);
+        endWrites(dirty);
+
+        --count_;
+    }
+
+    // Tombstones every live record in the n buckets starting at first;
+    // only used while the table is being drained.
+    void eraseBuckets(const int32_t first, const int32_t n)
+    {
+        std::vector<int32_t> touched;
+
+        for (int32_t b = first; b < first + n; ++b)
+        {
+            if (matchFull(ctrlOf(b)) != 0)
+            {
+                touched.push_back(b);
+            }
+        }
+
+        saveImages(touched);
+
+        int32_t erased = 0;
+
+        for (int32_t b = first; b < first + n; ++b)
+        {
+            uint8_t* ctrl = ctrlOf(b);
+            const uint64_t live = matchFull(ctrl);
+
+            if (live == 0)
+            {
+                continue;
+            }
+
+            markDirty();
+
+            for (uint64_t rest = live; rest != 0; rest &= rest - 1)
+            {
+                setMeta(ctrl[lowestBit(rest)], kCtrlDeleted);
+                ++erased;
+            }
+
+            writeAt(bucketOffset(b), ctrl, kBucketSlots);
+        }
+
+        count_ -= erased;
+    }
+
+    void setDraining(const bool draining)
+    {
+        draining_ = draining;
+    }
+
+    ProbeStats probeStats() const
+    {
+        ProbeStats stats;
+
+        for (int32_t b = 0; b < buckets_; ++b)
+        {
+            for (uint64_t live = matchFull(ctrlOf(b)); live != 0; live &= live - 1)
+            {
+                const int32_t idx = lowestBit(live);
+                const int32_t distance = distOf(b)[idx];
+                const int32_t slots = distance * kBucketSlots + idx;
+
+                ++stats.live;
+                stats.total_distance += distance;
+                stats.max_distance = std::max(stats.max_distance, distance);
+                stats.total_slots += slots;
+                stats.max_slots = std::max(stats.max_slots, slots);
+
+                if (static_cast<int32_t>(stats.histogram.size()) <= distance)
+                {
+                    stats.histogram.resize(distance + 1);
+                }
+                ++stats.histogram[distance];
+            }
+        }
+
+        return stats;
+    }
+
+    void flush() const
+    {
+        if (map_ != nullptr)
+        {
+            ::msync(map_, map_size_, MS_SYNC);
+        }
+        else if (fd_ >= 0)
+        {
+            ::fdatasync(fd_);
+        }
+    }
+};
+
+#endif
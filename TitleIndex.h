@@ -0,0 +1,309 @@
+#ifndef TITLE_INDEX_H
+#define TITLE_INDEX_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Table.h"
+
+using namespace std;
+
+constexpr uint32_t kTitleIndexMagic = 0x58444954;
+
+struct TitleIndexHeader
+{
+    uint32_t magic;
+    int32_t clean;
+    int64_t entries;
+};
+
+// One posting, as stored in the file: entries are sorted by hash, then id.
+struct TitleEntry
+{
+    uint64_t hash;
+    int32_t id;
+    int32_t reserved;
+};
+
+inline bool operator<(const TitleEntry& a, const TitleEntry& b)
+{
+    return a.hash < b.hash || (a.hash == b.hash && a.id < b.id);
+}
+
+inline bool operator==(const TitleEntry& a, const TitleEntry& b)
+{
+    return a.hash == b.hash && a.id == b.id;
+}
+
+// Hash index from title to the ids of the records carrying it. Only a
+// 64-bit hash of the title is kept, so the ids returned by find() are
+// candidates: the caller reads the records and compares the titles.
+// Postings live in memory, sorted by id, and are written to their own
+// file as a whole by flush(); as with the price index, the header is
+// marked dirty before the first change after that, so open() only
+// trusts a file written by a flush that finished.
+class TitleIndex
+{
+private:
+    string path_;
+    int fd_ = -1;
+    TitleIndexHeader header_{};
+    std::unordered_map<uint64_t, std::vector<int32_t>> postings_;
+    mutable std::mutex mutex_;
+
+    void readAt(const off_t offset, void* buf, const size_t len) const
+    {
+        char* ptr = static_cast<char*>(buf);
+        size_t done = 0;
+
+        while (done < len)
+        {
+            const ssize_t n = ::pread(fd_, ptr + done, len - done, offset + done);
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                throw std::runtime_error("Couldn't read title index");
+            }
+            done += n;
+        }
+    }
+
+    void writeAt(const off_t offset, const void* buf, const size_t len) const
+    {
+        const char* ptr = static_cast<const char*>(buf);
+        size_t done = 0;
+
+        while (done < len)
+        {
+            const ssize_t n = ::pwrite(fd_, ptr + done, len - done, offset + done);
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                throw std::runtime_error("Couldn't write title index");
+            }
+            done += n;
+        }
+    }
+
+    void writeHeader() const
+    {
+        writeAt(0, &header_, sizeof(header_));
+    }
+
+    void markDirty()
+    {
+        if (header_.clean != 0)
+        {
+            header_.clean = 0;
+            writeHeader();
+            ::fdatasync(fd_);
+        }
+    }
+
+public:
+    // FNV-1a over the title up to its terminator, finished with the
+    // murmur mixer so that similar titles spread over the whole range.
+    static uint64_t hash(const char* title)
+    {
+        uint64_t h = 0xcbf29ce484222325ULL;
+
+        for (const char* c = title; *c != '\0'; ++c)
+        {
+            h = (h ^ static_cast<uint8_t>(*c)) * 0x100000001b3ULL;
+        }
+
+        return murmurMix(h);
+    }
+
+    explicit TitleIndex(string path) : path_(std::move(path))
+    {
+    }
+
+    ~TitleIndex()
+    {
+        close();
+    }
+
+    TitleIndex(const TitleIndex&) = delete;
+    TitleIndex& operator=(const TitleIndex&) = delete;
+
+    // Returns false if the file is new, foreign or wasn't flushed after
+    // its last change; it then has to be rebuilt before use.
+    bool open()
+    {
+        close();
+
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+
+        if (fd_ < 0)
+        {
+            throw std::runtime_error("Title index file didn't open");
+        }
+
+        postings_.clear();
+
+        if (::pread(fd_, &header_, sizeof(header_), 0) != static_cast<ssize_t>(sizeof(header_)) ||
+            header_.magic != kTitleIndexMagic || header_.clean == 0)
+        {
+            header_ = TitleIndexHeader{kTitleIndexMagic, 0, 0};
+            return false;
+        }
+
+        std::vector<TitleEntry> entries(header_.entries);
+        readAt(sizeof(header_), entries.data(), entries.size() * sizeof(TitleEntry));
+
+        for (const TitleEntry& entry : entries)
+        {
+            postings_[entry.hash].push_back(entry.id);
+        }
+
+        return true;
+    }
+
+    void close()
+    {
+        if (fd_ >= 0)
+        {
+            flush();
+            ::close(fd_);
+            fd_ = -1;
+        }
+        postings_.clear();
+    }
+
+    int64_t entries() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return header_.entries;
+    }
+
+    void rebuild(std::vector<TitleEntry> entries)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        std::sort(entries.begin(), entries.end());
+        entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+
+        header_ = TitleIndexHeader{kTitleIndexMagic, 0, static_cast<int64_t>(entries.size())};
+        writeHeader();
+        ::fdatasync(fd_);
+
+        postings_.clear();
+
+        for (const TitleEntry& entry : entries)
+        {
+            postings_[entry.hash].push_back(entry.id);
+        }
+    }
+
+    void insert(const char* title, const int32_t id)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        std::vector<int32_t>& ids = postings_[hash(title)];
+        const auto it = std::lower_bound(ids.begin(), ids.end(), id);
+
+        if (it != ids.end() && *it == id)
+        {
+            return;
+        }
+
+        markDirty();
+
+        ids.insert(it, id);
+        ++header_.entries;
+    }
+
+    void erase(const char* title, const int32_t id)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        const auto posting = postings_.find(hash(title));
+
+        if (posting == postings_.end())
+        {
+            return;
+        }
+
+        std::vector<int32_t>& ids = posting->second;
+        const auto it = std::lower_bound(ids.begin(), ids.end(), id);
+
+        if (it == ids.end() || *it != id)
+        {
+            return;
+        }
+
+        markDirty();
+
+        ids.erase(it);
+        --header_.entries;
+
+        if (ids.empty())
+        {
+            postings_.erase(posting);
+        }
+    }
+
+    // Ids of the records whose title may be title, in id order.
+    std::vector<int32_t> find(const string& title) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        const auto posting = postings_.find(hash(title.c_str()));
+
+        return posting == postings_.end() ? std::vector<int32_t>() : posting->second;
+    }
+
+    // Writes every posting out and marks the file clean.
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (fd_ < 0 || header_.clean != 0)
+        {
+            return;
+        }
+
+        std::vector<TitleEntry> entries;
+        entries.reserve(header_.entries);
+
+        for (const auto& [h, ids] : postings_)
+        {
+            for (const int32_t id : ids)
+            {
+                entries.push_back(TitleEntry{h, id, 0});
+            }
+        }
+
+        std::sort(entries.begin(), entries.end());
+
+        if (::ftruncate(fd_, sizeof(header_) + entries.size() * sizeof(TitleEntry)) != 0)
+        {
+            throw std::runtime_error("Couldn't resize title index");
+        }
+
+        writeAt(sizeof(header_), entries.data(), entries.size() * sizeof(TitleEntry));
+        ::fdatasync(fd_);
+
+        header_.clean = 1;
+        writeHeader();
+        ::fdatasync(fd_);
+    }
+};
+
+#endif
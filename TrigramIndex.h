@@ -0,0 +1,341 @@
+#ifndef TRIGRAM_INDEX_H
+#define TRIGRAM_INDEX_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Compacting only pays off once this many titles are dead.
+constexpr int32_t kTrigramMinDead = 1024;
+
+// Term numbers in ascending order, delta-encoded as varints; terms are
+// numbered in the order they're added, so new ones are appended.
+struct TrigramPosting
+{
+    std::vector<uint8_t> bytes;
+    uint32_t last = 0;
+
+    void append(const uint32_t term)
+    {
+        uint32_t delta = bytes.empty() ? term : term - last;
+
+        while (delta >= 0x80)
+        {
+            bytes.push_back(static_cast<uint8_t>(delta | 0x80));
+            delta >>= 7;
+        }
+        bytes.push_back(static_cast<uint8_t>(delta));
+
+        last = term;
+    }
+
+    template <class F>
+    void forEach(F f) const
+    {
+        uint32_t term = 0;
+        uint32_t delta = 0;
+        int shift = 0;
+
+        for (const uint8_t byte : bytes)
+        {
+            delta |= static_cast<uint32_t>(byte & 0x7F) << shift;
+            shift += 7;
+
+            if ((byte & 0x80) == 0)
+            {
+                term += delta;
+                f(term);
+                delta = 0;
+                shift = 0;
+            }
+        }
+    }
+};
+
+// Inverted index from the byte trigrams of the distinct titles to the
+// titles containing them, for substring and typo-tolerant search. Each
+// distinct title is a term with a record count; a term whose count
+// drops to 0 stays in the postings, is skipped by queries, and comes
+// back as is if the title reappears. Once dead terms outnumber live
+// ones the postings are rebuilt from the live terms only. Nothing is
+// stored on disk: the index is built from the prefix index's titles.
+class TrigramIndex
+{
+private:
+    std::vector<string> terms_;
+    std::vector<int32_t> counts_;
+    std::unordered_map<string, uint32_t> term_of_;
+    std::unordered_map<uint32_t, TrigramPosting> postings_;
+    int32_t dead_ = 0;
+    mutable std::mutex mutex_;
+
+    static uint32_t trigram(const string& s, const size_t i)
+    {
+        return static_cast<uint32_t>(static_cast<uint8_t>(s[i])) << 16 |
+               static_cast<uint32_t>(static_cast<uint8_t>(s[i + 1])) << 8 |
+               static_cast<uint32_t>(static_cast<uint8_t>(s[i + 2]));
+    }
+
+    static std::vector<uint32_t> trigrams(const string& s)
+    {
+        std::vector<uint32_t> result;
+
+        for (size_t i = 0; i + 3 <= s.size(); ++i)
+        {
+            result.push_back(trigram(s, i));
+        }
+
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+
+        return result;
+    }
+
+    void addTerm(const string& title, const int32_t count)
+    {
+        const auto found = term_of_.find(title);
+
+        if (found != term_of_.end())
+        {
+            if (counts_[found->second] == 0)
+            {
+                --dead_;
+            }
+            counts_[found->second] += count;
+            return;
+        }
+
+        const uint32_t term = static_cast<uint32_t>(terms_.size());
+
+        terms_.push_back(title);
+        counts_.push_back(count);
+        term_of_.emplace(title, term);
+
+        for (const uint32_t gram : trigrams(title))
+        {
+            postings_[gram].append(term);
+        }
+    }
+
+    void compact()
+    {
+        std::vector<string> terms;
+        std::vector<int32_t> counts;
+
+        for (size_t i = 0; i < terms_.size(); ++i)
+        {
+            if (counts_[i] > 0)
+            {
+                terms.push_back(std::move(terms_[i]));
+                counts.push_back(counts_[i]);
+            }
+        }
+
+        clear();
+
+        for (size_t i = 0; i < terms.size(); ++i)
+        {
+            addTerm(terms[i], counts[i]);
+        }
+    }
+
+    void clear()
+    {
+        terms_.clear();
+        counts_.clear();
+        term_of_.clear();
+        postings_.clear();
+        dead_ = 0;
+    }
+
+    // Edit distance of a and b if it is at most max_edits, otherwise
+    // max_edits + 1; rows stop as soon as no cell is within the bound.
+    static int32_t editDistance(const string& a, const string& b, const int32_t max_edits)
+    {
+        const int32_t n = static_cast<int32_t>(a.size());
+        const int32_t m = static_cast<int32_t>(b.size());
+
+        if (std::abs(n - m) > max_edits)
+        {
+            return max_edits + 1;
+        }
+
+        std::vector<int32_t> row(m + 1);
+        std::vector<int32_t> next(m + 1);
+
+        for (int32_t j = 0; j <= m; ++j)
+        {
+            row[j] = j;
+        }
+
+        for (int32_t i = 1; i <= n; ++i)
+        {
+            next[0] = i;
+            int32_t best = next[0];
+
+            for (int32_t j = 1; j <= m; ++j)
+            {
+                next[j] = std::min({row[j] + 1, next[j - 1] + 1, row[j - 1] + (a[i - 1] != b[j - 1])});
+                best = std::min(best, next[j]);
+            }
+
+            if (best > max_edits)
+            {
+                return max_edits + 1;
+            }
+
+            row.swap(next);
+        }
+
+        return std::min(row[m], max_edits + 1);
+    }
+
+    // Live terms sharing at least min_shared of the query's distinct
+    // trigrams; with min_shared <= 0 that filters nothing, so every live
+    // term is a candidate.
+    std::vector<uint32_t> candidates(const string& query, const int32_t min_shared) const
+    {
+        std::vector<uint32_t> result;
+
+        if (min_shared <= 0)
+        {
+            for (uint32_t term = 0; term < terms_.size(); ++term)
+            {
+                if (counts_[term] > 0)
+                {
+                    result.push_back(term);
+                }
+            }
+            return result;
+        }
+
+        std::vector<uint16_t> shared(terms_.size());
+        std::vector<uint32_t> touched;
+
+        for (const uint32_t gram : trigrams(query))
+        {
+            const auto posting = postings_.find(gram);
+
+            if (posting != postings_.end())
+            {
+                posting->second.forEach([&](const uint32_t term)
+                {
+                    if (shared[term]++ == 0)
+                    {
+                        touched.push_back(term);
+                    }
+                });
+            }
+        }
+
+        for (const uint32_t term : touched)
+        {
+            if (counts_[term] > 0 && shared[term] >= min_shared)
+            {
+                result.push_back(term);
+            }
+        }
+
+        return result;
+    }
+
+public:
+    // Replaces the index with these titles and record counts.
+    void rebuild(const std::vector<std::pair<string, int32_t>>& titles)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        clear();
+
+        for (const auto& [title, count] : titles)
+        {
+            addTerm(title, count);
+        }
+    }
+
+    void insert(const char* title)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        addTerm(title, 1);
+    }
+
+    void erase(const char* title)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        const auto found = term_of_.find(title);
+
+        if (found == term_of_.end() || counts_[found->second] == 0)
+        {
+            return;
+        }
+
+        if (--counts_[found->second] == 0)
+        {
+            ++dead_;
+
+            if (dead_ >= kTrigramMinDead && static_cast<size_t>(dead_) * 2 > terms_.size())
+            {
+                compact();
+            }
+        }
+    }
+
+    // Titles containing text, in byte order. Every trigram of text must
+    // occur in the title, which leaves few candidates to check.
+    std::vector<string> containing(const string& text) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        std::vector<string> result;
+
+        for (const uint32_t term : candidates(text, static_cast<int32_t>(trigrams(text).size())))
+        {
+            if (terms_[term].find(text) != string::npos)
+            {
+                result.push_back(terms_[term]);
+            }
+        }
+
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    // Titles within max_edits insertions, deletions or substitutions of
+    // title, closest first, then in byte order. Each edit destroys at
+    // most three of the query's trigrams, so a match shares all but
+    // 3 * max_edits of them; the survivors are checked exactly.
+    std::vector<std::pair<string, int32_t>> similar(const string& title, const int32_t max_edits) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        const int32_t min_shared = static_cast<int32_t>(trigrams(title).size()) - 3 * max_edits;
+        std::vector<std::pair<string, int32_t>> result;
+
+        for (const uint32_t term : candidates(title, min_shared))
+        {
+            const int32_t distance = editDistance(title, terms_[term], max_edits);
+
+            if (distance <= max_edits)
+            {
+                result.emplace_back(terms_[term], distance);
+            }
+        }
+
+        std::sort(result.begin(), result.end(), [](const auto& a, const auto& b)
+        {
+            return a.second < b.second || (a.second == b.second && a.first < b.first);
+        });
+        return result;
+    }
+};
+
+#endif
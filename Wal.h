@@ -0,0 +1,339 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+enum class WalOp : int32_t
+{
+    INSERT = 1,
+    UPDATE = 2,
+    DELETE_ID = 3,
+    DELETE_TITLE = 4,
+    DELETE_PRICE = 5,
+    DELETE_QUANTITY = 6
+};
+
+// One logical change. Entries are replayed through the public Database
+// API, so each op only has to be idempotent against the table state.
+struct WalEntry
+{
+    uint32_t crc;
+    WalOp op;
+    int32_t id;
+    int32_t quantity;
+    double price;
+    char title[64];
+};
+
+struct WalOptions
+{
+    bool enabled = true;
+    int32_t window_us = 0;
+    int32_t max_group = 64;
+};
+
+struct WalStats
+{
+    uint64_t entries = 0;
+    uint64_t syncs = 0;
+};
+
+inline uint32_t crc32(const void* data, const size_t len)
+{
+    static const std::vector<uint32_t> table = []
+    {
+        std::vector<uint32_t> result(256);
+
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t c = i;
+
+            for (int k = 0; k < 8; ++k)
+            {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            result[i] = c;
+        }
+        return result;
+    }();
+
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint32_t crc = 0xFFFFFFFFu;
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xFFFFFFFFu;
+}
+
+inline uint32_t entryCrc(const WalEntry& entry)
+{
+    return crc32(reinterpret_cast<const char*>(&entry) + sizeof(entry.crc), sizeof(entry) - sizeof(entry.crc));
+}
+
+// Append-only redo log of logical changes (no page images) with group
+// commit. append() only buffers the entry; commit() blocks until it is
+// on disk. The first committer that finds no sync running becomes the
+// leader: it optionally waits up to window for more entries, then writes
+// everything buffered so far with one write and one fdatasync, and wakes
+// all followers it covered.
+class Wal
+{
+private:
+    string path_;
+    std::chrono::microseconds window_;
+    size_t max_group_;
+    int fd_ = -1;
+    off_t size_ = 0;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<WalEntry> buffer_;
+    uint64_t appended_ = 0;
+    uint64_t durable_ = 0;
+    bool flushing_ = false;
+    bool failed_ = false;
+    WalStats stats_;
+
+    void writeAll(const void* data, const size_t len, const off_t offset) const
+    {
+        const char* ptr = static_cast<const char*>(data);
+        size_t done = 0;
+
+        while (done < len)
+        {
+            const ssize_t n = ::pwrite(fd_, ptr + done, len - done, offset + done);
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                throw std::runtime_error("Couldn't write to WAL");
+            }
+            done += n;
+        }
+    }
+
+public:
+    Wal(string path, const std::chrono::microseconds window, const size_t max_group)
+        : path_(std::move(path)), window_(window), max_group_(std::max<size_t>(max_group, 1))
+    {
+    }
+
+    ~Wal()
+    {
+        close();
+    }
+
+    Wal(const Wal&) = delete;
+    Wal& operator=(const Wal&) = delete;
+
+    bool isOpen() const
+    {
+        return fd_ >= 0;
+    }
+
+    void open()
+    {
+        close();
+
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+
+        if (fd_ < 0)
+        {
+            throw std::runtime_error("WAL file didn't open");
+        }
+
+        size_ = ::lseek(fd_, 0, SEEK_END);
+        failed_ = false;
+    }
+
+    void close()
+    {
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    off_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return size_;
+    }
+
+    // Calls apply(entry) for every intact entry in file order and stops
+    // at the first torn or corrupted one.
+    template <class F>
+    int64_t replay(F apply) const
+    {
+        constexpr size_t kChunk = 4096;
+        std::vector<WalEntry> chunk(kChunk);
+        int64_t applied = 0;
+        off_t offset = 0;
+
+        while (true)
+        {
+            const ssize_t n = ::pread(fd_, chunk.data(), kChunk * sizeof(WalEntry), offset);
+
+            if (n <= 0)
+            {
+                return applied;
+            }
+
+            const size_t entries = n / sizeof(WalEntry);
+
+            for (size_t i = 0; i < entries; ++i)
+            {
+                if (chunk[i].crc != entryCrc(chunk[i]))
+                {
+                    return applied;
+                }
+
+                apply(chunk[i]);
+                ++applied;
+            }
+
+            if (entries < kChunk)
+            {
+                return applied;
+            }
+            offset += n;
+        }
+    }
+
+    uint64_t append(WalEntry entry)
+    {
+        entry.crc = entryCrc(entry);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        buffer_.push_back(entry);
+
+        if (buffer_.size() >= max_group_)
+        {
+            cv_.notify_all();
+        }
+
+        return ++appended_;
+    }
+
+    void commit(const uint64_t lsn)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        while (durable_ < lsn)
+        {
+            if (failed_)
+            {
+                throw std::runtime_error("WAL is unusable after a failed fdatasync");
+            }
+
+            if (flushing_)
+            {
+                cv_.wait(lock);
+                continue;
+            }
+
+            flushing_ = true;
+
+            if (window_.count() > 0 && buffer_.size() < max_group_)
+            {
+                cv_.wait_for(lock, window_, [&] { return buffer_.size() >= max_group_; });
+            }
+
+            std::vector<WalEntry> batch;
+            batch.swap(buffer_);
+            const uint64_t upto = appended_;
+            const off_t offset = size_;
+            const size_t len = batch.size() * sizeof(WalEntry);
+
+            lock.unlock();
+
+            bool written = false;
+
+            try
+            {
+                writeAll(batch.data(), len, offset);
+                written = true;
+
+                if (::fdatasync(fd_) != 0)
+                {
+                    throw std::runtime_error("Couldn't fdatasync WAL");
+                }
+            }
+            catch (...)
+            {
+                // None of the batch is known to be on disk, so it goes back
+                // in front of the newer entries and durable_ stays put. A
+                // failed write is retried by the next commit at the same
+                // offset. A failed fdatasync isn't: the kernel may already
+                // have dropped the pages, and a second fdatasync could then
+                // succeed without them, so the log refuses every commit
+                // until reset() or open().
+                lock.lock();
+                buffer_.insert(buffer_.begin(), batch.begin(), batch.end());
+                failed_ = failed_ || written;
+                flushing_ = false;
+                cv_.notify_all();
+                throw;
+            }
+
+            lock.lock();
+
+            size_ = offset + len;
+            durable_ = std::max(durable_, upto);
+            flushing_ = false;
+            stats_.entries += batch.size();
+            ++stats_.syncs;
+
+            cv_.notify_all();
+        }
+    }
+
+    // Drops the log once the table files are known to hold everything it
+    // describes; entries still buffered count as durable from now on.
+    void reset()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        cv_.wait(lock, [&] { return !flushing_; });
+
+        buffer_.clear();
+        durable_ = appended_;
+        failed_ = false;
+
+        if (fd_ >= 0 && ::ftruncate(fd_, 0) != 0)
+        {
+            throw std::runtime_error("Couldn't truncate WAL");
+        }
+        size_ = 0;
+
+        cv_.notify_all();
+    }
+
+    WalStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+};
+
+#endif
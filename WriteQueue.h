@@ -0,0 +1,161 @@
+#ifndef WRITE_QUEUE_H
+#define WRITE_QUEUE_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+enum class QueuedOp { INSERT, UPDATE, DELETE_ID };
+
+struct QueuedWrite
+{
+    QueuedOp op;
+    int32_t id;
+    string title;
+    double price;
+    int32_t quantity;
+    std::promise<bool> done;
+};
+
+struct QueueOptions
+{
+    bool enabled = false;
+    int32_t max_batch = 256;
+    int32_t window_us = 0;
+};
+
+struct QueueStats
+{
+    int64_t depth = 0;
+    int64_t max_depth = 0;
+    int64_t batches = 0;
+    int64_t ops = 0;
+    int64_t max_batch = 0;
+};
+
+// Point writes handed to one writer thread. Callers block on a future
+// while the thread takes everything queued so far (up to max_batch) and
+// passes it to apply in one go, which must fulfil every promise. With a
+// window, the thread first waits that long for the batch to fill up,
+// trading latency of the first write for fewer, larger batches.
+class WriteQueue
+{
+private:
+    size_t max_batch_;
+    std::chrono::microseconds window_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<QueuedWrite> queue_;
+    bool stop_ = false;
+    std::thread thread_;
+    QueueStats stats_;
+
+public:
+    WriteQueue(const int32_t max_batch, const std::chrono::microseconds window)
+        : max_batch_(std::max<int32_t>(max_batch, 1)), window_(window)
+    {
+    }
+
+    ~WriteQueue()
+    {
+        stop();
+    }
+
+    WriteQueue(const WriteQueue&) = delete;
+    WriteQueue& operator=(const WriteQueue&) = delete;
+
+    bool running() const
+    {
+        return thread_.joinable();
+    }
+
+    void start(std::function<void(std::vector<QueuedWrite>&)> apply)
+    {
+        thread_ = std::thread([this, apply]
+        {
+            std::vector<QueuedWrite> batch;
+
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    cv_.wait(lock, [&] { return stop_ || !queue_.empty(); });
+
+                    if (queue_.empty())
+                    {
+                        return;
+                    }
+
+                    if (window_.count() > 0 && !stop_ && queue_.size() < max_batch_)
+                    {
+                        cv_.wait_for(lock, window_, [&] { return stop_ || queue_.size() >= max_batch_; });
+                    }
+
+                    const size_t n = std::min(max_batch_, queue_.size());
+
+                    batch.clear();
+                    for (size_t i = 0; i < n; ++i)
+                    {
+                        batch.push_back(std::move(queue_.front()));
+                        queue_.pop_front();
+                    }
+
+                    stats_.depth = queue_.size();
+                    ++stats_.batches;
+                    stats_.ops += n;
+                    stats_.max_batch = std::max<int64_t>(stats_.max_batch, n);
+                }
+
+                apply(batch);
+            }
+        });
+    }
+
+    // Remaining writes are still applied before the thread exits.
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+
+        if (thread_.joinable())
+        {
+            thread_.join();
+        }
+    }
+
+    std::future<bool> push(QueuedWrite write)
+    {
+        std::future<bool> result = write.done.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            queue_.push_back(std::move(write));
+            stats_.depth = queue_.size();
+            stats_.max_depth = std::max<int64_t>(stats_.max_depth, stats_.depth);
+        }
+        cv_.notify_one();
+
+        return result;
+    }
+
+    QueueStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+};
+
+#endif
@@ -0,0 +1,934 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <unistd.h>
+#include "Database.h"
+
+using namespace std;
+
+// Micro-benchmarks for the storage engine. Run with `make bench`; like
+// `make check` it works in a fresh temporary directory. Numbers depend
+// on the machine and the file system of /tmp, so compare runs made on
+// the same one.
+
+constexpr int32_t kBenchRecords = 200000;
+constexpr double kBenchSeconds = 1.0;
+
+static int failures = 0;
+
+// Results go here; cout itself is silenced while benchmarks run, since
+// every resize announces itself there.
+static std::ostream report(std::cout.rdbuf());
+
+static double secondsSince(const chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static WalOptions noWal()
+{
+    WalOptions wal;
+    wal.enabled = false;
+    return wal;
+}
+
+// Runs f in an empty subdirectory, so every benchmark starts without
+// store files; the Database has to be destroyed inside f.
+template <class F>
+static void inFreshDirectory(const string& name, F f)
+{
+    std::filesystem::create_directory(name);
+    std::filesystem::current_path(name);
+    f();
+    std::filesystem::current_path("..");
+    std::filesystem::remove_all(name);
+}
+
+static void fill(Database& db, const int32_t n)
+{
+    for (int32_t id = 1; id <= n; ++id)
+    {
+        db.insert(id, "item" + to_string(id % 100), id % 1000, id % 50);
+    }
+}
+
+// Probe lengths for keys that a weak hash would cluster and for random
+// ones, with each mixer: mean and max distance in buckets past the home
+// bucket and in slots from its first slot, then the bucket histogram.
+static void benchProbeLengths()
+{
+    report << "Probe lengths, " << kBenchRecords << " records (buckets / slots):" << endl;
+
+    const pair<const char*, int32_t> patterns[] = {{"sequential", 1}, {"strided", 4096}, {"random", 0}};
+    const pair<const char*, HashKind> mixers[] = {{"murmur", HashKind::MURMUR}, {"xxhash", HashKind::XXHASH}};
+
+    for (const auto& [mixer, kind] : mixers)
+    {
+        for (const auto& [name, stride] : patterns)
+        {
+            inFreshDirectory("probe", [&, mixer = mixer, kind = kind, name = name, stride = stride]
+            {
+                Database db(Backend::PREAD, SyncMode::NONE, kind, noWal());
+                std::mt19937 rng(1);
+
+                for (int32_t i = 1; i <= kBenchRecords; ++i)
+                {
+                    const int32_t id = stride != 0 ? i * stride : static_cast<int32_t>(rng() % INT32_MAX) + 1;
+                    db.insert(id, "item", 1.0, 1);
+                }
+
+                const DbStats stats = db.stats();
+
+                report << "  " << setw(6) << left << mixer << " " << setw(10) << name << right << " mean " << fixed
+                       << setprecision(3) << stats.mean_probe << " / " << setprecision(1) << stats.mean_probe_slots
+                       << " max " << stats.max_probe << " / " << stats.max_probe_slots << "  histogram";
+
+                for (size_t distance = 0; distance < stats.probe_histogram.size(); ++distance)
+                {
+                    if (stats.probe_histogram[distance] != 0)
+                    {
+                        report << " " << distance << ":" << stats.probe_histogram[distance];
+                    }
+                }
+                report << endl;
+            });
+        }
+    }
+}
+
+// Read syscalls (pread included) this process has made so far, from
+// syscr in /proc/self/io; -1 where that file doesn't exist.
+static int64_t readSyscalls()
+{
+    std::ifstream io("/proc/self/io");
+    string key;
+    int64_t value = 0;
+
+    while (io >> key >> value)
+    {
+        if (key == "syscr:")
+        {
+            return value;
+        }
+    }
+    return -1;
+}
+
+// Read syscalls made by f, less what reading /proc/self/io itself costs.
+template <class F>
+static int64_t countReads(F f)
+{
+    const int64_t empty = readSyscalls();
+    const int64_t before = readSyscalls();
+    f();
+    const int64_t after = readSyscalls();
+
+    return after - before - (before - empty);
+}
+
+// Read syscalls and time per findById with the pread backend, for ids
+// that exist and for ids that don't, next to an emulation of the old
+// path that opened store.db with an ifstream, read from it and closed it
+// again on every call (that adds one open and one close per lookup).
+static void benchLookupSyscalls()
+{
+    inFreshDirectory("syscalls", []
+    {
+        Database db(Backend::PREAD, SyncMode::NONE, HashKind::MURMUR, noWal());
+        fill(db, kBenchRecords);
+
+        constexpr int32_t kLookups = 100000;
+        const int32_t buckets = db.stats().capacity / kBucketSlots;
+
+        auto lookups = [&](const char* name, const int32_t first_id)
+        {
+            std::mt19937 rng(2);
+            const auto start = chrono::steady_clock::now();
+
+            const int64_t reads = countReads([&]
+            {
+                for (int32_t i = 0; i < kLookups; ++i)
+                {
+                    int disk_reads = 0;
+                    db.findById(first_id + static_cast<int32_t>(rng() % kBenchRecords), disk_reads);
+                }
+            });
+
+            report << "  " << setw(20) << left << name << right << fixed << setprecision(3)
+                   << static_cast<double>(reads) / kLookups << " reads, " << setprecision(2)
+                   << secondsSince(start) / kLookups * 1e6 << " us" << endl;
+        };
+
+        report << "findById, read syscalls and time per call:" << endl;
+
+        if (readSyscalls() < 0)
+        {
+            report << "  /proc/self/io isn't available" << endl;
+            return;
+        }
+
+        lookups("pread, hit", 1);
+        lookups("pread, miss", kBenchRecords + 1);
+
+        std::mt19937 rng(2);
+        Bucket page;
+        const auto start = chrono::steady_clock::now();
+
+        const int64_t reads = countReads([&]
+        {
+            for (int32_t i = 0; i < kLookups; ++i)
+            {
+                std::ifstream file(kDbFile, std::ios::binary);
+                file.seekg(static_cast<off_t>(rng() % buckets + 1) * kPageSize);
+                file.read(reinterpret_cast<char*>(&page), sizeof(page));
+            }
+        });
+
+        report << "  " << setw(20) << left << "open per call" << right << fixed << setprecision(3)
+               << static_cast<double>(reads) / kLookups << " reads, " << setprecision(2)
+               << secondsSince(start) / kLookups * 1e6 << " us (+1 open, +1 close)" << endl;
+    });
+}
+
+struct WriterRun
+{
+    double inserts_per_second = 0.0;
+    double mean_latency_us = 0.0;
+};
+
+// writers threads insert distinct ids into db for kBenchSeconds; returns
+// the rate of acknowledged inserts and how long one took on average.
+static WriterRun runWriters(Database& db, const int32_t writers)
+{
+    std::atomic<bool> stop{false};
+    std::atomic<int64_t> done{0};
+    std::atomic<int64_t> waited_ns{0};
+    std::vector<std::thread> threads;
+
+    const auto start = chrono::steady_clock::now();
+
+    for (int32_t t = 0; t < writers; ++t)
+    {
+        threads.emplace_back([&, t]
+        {
+            int64_t n = 0;
+            chrono::steady_clock::duration waited{};
+
+            for (int32_t id = t + 1; !stop.load(); id += writers)
+            {
+                const auto before = chrono::steady_clock::now();
+                db.insert(id, "item", 1.0, 1);
+                waited += chrono::steady_clock::now() - before;
+                ++n;
+            }
+            done += n;
+            waited_ns += chrono::duration_cast<chrono::nanoseconds>(waited).count();
+        });
+    }
+
+    std::this_thread::sleep_for(chrono::duration<double>(kBenchSeconds));
+    stop = true;
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    WriterRun run;
+    run.inserts_per_second = done / secondsSince(start);
+    run.mean_latency_us = done == 0 ? 0.0 : waited_ns / 1e3 / done;
+    return run;
+}
+
+// Inserts acknowledged per second with the WAL on, and how many of them
+// share one fdatasync, for 1, 8 and 64 concurrent writers.
+static void benchWalWriters()
+{
+    report << "WAL group commit, " << fixed << setprecision(1) << kBenchSeconds << " s per run:" << endl;
+
+    for (const int32_t writers : {1, 8, 64})
+    {
+        inFreshDirectory("wal", [writers]
+        {
+            Database db;
+            const WriterRun run = runWriters(db, writers);
+            const WalStats wal = db.stats().wal;
+
+            report << "  " << setw(2) << writers << " writers: " << fixed << setprecision(0) << run.inserts_per_second
+                   << " inserts/s, " << setprecision(1)
+                   << (wal.syncs != 0 ? static_cast<double>(wal.entries) / wal.syncs : 0.0) << " entries per fdatasync"
+                   << endl;
+        });
+    }
+}
+
+// The same concurrent inserts applied by the calling threads and through
+// the single writer thread (--write-queue), WAL on in both; for the
+// queue also its deepest backlog and mean batch.
+static void benchWriteQueue()
+{
+    report << "Write queue, " << fixed << setprecision(1) << kBenchSeconds << " s per run:" << endl;
+
+    for (const int32_t writers : {1, 8, 64})
+    {
+        for (const bool queued : {false, true})
+        {
+            inFreshDirectory("queue", [writers, queued]
+            {
+                QueueOptions queue;
+                queue.enabled = queued;
+
+                Database db(Backend::PREAD, SyncMode::NONE, HashKind::MURMUR, WalOptions(), queue);
+                const WriterRun run = runWriters(db, writers);
+                const QueueStats stats = db.stats().queue;
+
+                report << "  " << setw(2) << writers << " writers, " << (queued ? "queued: " : "direct: ") << fixed
+                       << setprecision(0) << run.inserts_per_second << " inserts/s";
+
+                if (queued)
+                {
+                    report << ", max depth " << stats.max_depth << ", mean batch " << setprecision(1)
+                           << (stats.batches == 0 ? 0.0 : static_cast<double>(stats.ops) / stats.batches);
+                }
+                report << endl;
+            });
+        }
+    }
+}
+
+// The writer queue's batching window (--write-window-us) against 8
+// inserting threads, WAL off so that only applying the batches counts:
+// throughput, mean insert latency and mean batch. With --write-batch at
+// 8 the window closes as soon as every writer is queued; at the default
+// 256 it always runs out.
+static void benchBatchWindow()
+{
+    constexpr int32_t kWriters = 8;
+
+    report << "Write queue window, " << kWriters << " writers:" << endl;
+
+    for (const int32_t max_batch : {kWriters, QueueOptions().max_batch})
+    {
+        for (const int32_t window_us : {0, 100, 1000})
+        {
+            inFreshDirectory("window", [max_batch, window_us]
+            {
+                QueueOptions queue;
+                queue.enabled = true;
+                queue.max_batch = max_batch;
+                queue.window_us = window_us;
+
+                Database db(Backend::PREAD, SyncMode::NONE, HashKind::MURMUR, noWal(), queue);
+                const WriterRun run = runWriters(db, kWriters);
+                const QueueStats stats = db.stats().queue;
+
+                report << "  batch " << setw(3) << max_batch << ", " << setw(4) << window_us << " us: " << fixed
+                       << setprecision(0) << run.inserts_per_second << " inserts/s, " << setprecision(1)
+                       << run.mean_latency_us << " us per insert, mean batch "
+                       << (stats.batches == 0 ? 0.0 : static_cast<double>(stats.ops) / stats.batches) << endl;
+            });
+        }
+    }
+}
+
+// Every thread runs random inserts, updates, deletes and lookups on its
+// own range of ids and checks each result against its own model.
+static void benchStress()
+{
+    inFreshDirectory("stress", []
+    {
+        Database db(Backend::PREAD, SyncMode::NONE, HashKind::MURMUR, noWal());
+
+        const int32_t threads_n = static_cast<int32_t>(std::clamp(std::thread::hardware_concurrency(), 4u, 16u));
+        constexpr int32_t kOps = 50000;
+        constexpr int32_t kIdsPerThread = 20000;
+
+        std::atomic<int64_t> mismatches{0};
+        std::vector<std::thread> threads;
+        const auto start = chrono::steady_clock::now();
+
+        for (int32_t t = 0; t < threads_n; ++t)
+        {
+            threads.emplace_back([&, t]
+            {
+                std::mt19937 rng(t);
+                std::unordered_map<int32_t, int32_t> model;
+
+                for (int32_t i = 0; i < kOps; ++i)
+                {
+                    const int32_t id = t * kIdsPerThread + static_cast<int32_t>(rng() % kIdsPerThread) + 1;
+                    const int32_t quantity = static_cast<int32_t>(rng() % 1000);
+                    const bool present = model.count(id) != 0;
+                    int disk_reads = 0;
+
+                    switch (rng() % 4)
+                    {
+                    case 0:
+                        if (db.insert(id, "item", 1.0, quantity) == present)
+                        {
+                            ++mismatches;
+                        }
+                        model.emplace(id, quantity);
+                        break;
+                    case 1:
+                        if (db.update(id, "item", 2.0, quantity) != present)
+                        {
+                            ++mismatches;
+                        }
+                        if (present)
+                        {
+                            model[id] = quantity;
+                        }
+                        break;
+                    case 2:
+                        if (db.deleteById(id) != present)
+                        {
+                            ++mismatches;
+                        }
+                        model.erase(id);
+                        break;
+                    default:
+                    {
+                        const std::optional<Record> record = db.findById(id, disk_reads);
+
+                        if (record.has_value() != present || (present && record->quantity != model[id]))
+                        {
+                            ++mismatches;
+                        }
+                        break;
+                    }
+                    }
+                }
+            });
+        }
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        const double seconds = secondsSince(start);
+
+        report << "Stress, " << threads_n << " threads: " << fixed << setprecision(0)
+               << threads_n * static_cast<double>(kOps) / seconds << " ops/s, " << mismatches << " mismatches" << endl;
+
+        if (mismatches != 0)
+        {
+            ++failures;
+        }
+    });
+}
+
+// Lock-free findById throughput of four readers while 0, 1, 2 and 4
+// writers update records as fast as they can.
+static void benchReadsUnderWrites()
+{
+    constexpr int32_t kReaders = 4;
+
+    report << "findById with " << kReaders << " readers:" << endl;
+
+    inFreshDirectory("reads", []
+    {
+        Database db(Backend::PREAD, SyncMode::NONE, HashKind::MURMUR, noWal());
+        fill(db, kBenchRecords);
+
+        for (const int32_t writers : {0, 1, 2, 4})
+        {
+            std::atomic<bool> stop{false};
+            std::atomic<int64_t> reads{0};
+            std::atomic<int64_t> writes{0};
+            std::vector<std::thread> threads;
+
+            for (int32_t t = 0; t < kReaders + writers; ++t)
+            {
+                threads.emplace_back([&, t]
+                {
+                    std::mt19937 rng(t);
+                    int64_t n = 0;
+
+                    while (!stop.load())
+                    {
+                        const int32_t id = static_cast<int32_t>(rng() % kBenchRecords) + 1;
+
+                        if (t < kReaders)
+                        {
+                            int disk_reads = 0;
+                            db.findById(id, disk_reads);
+                        }
+                        else
+                        {
+                            db.update(id, "item", static_cast<double>(n % 1000), static_cast<int32_t>(n % 50));
+                        }
+                        ++n;
+                    }
+
+                    (t < kReaders ? reads : writes) += n;
+                });
+            }
+
+            std::this_thread::sleep_for(chrono::duration<double>(kBenchSeconds));
+            stop = true;
+
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+
+            report << "  " << writers << " writers: " << fixed << setprecision(0) << reads / kBenchSeconds
+                   << " reads/s, " << writes / kBenchSeconds << " writes/s" << endl;
+        }
+    });
+}
+
+// Full scans: findByPrice runs the SIMD kernels over the in-memory
+// price column, getAll streams the records from the table file.
+static void benchScans()
+{
+    inFreshDirectory("scan", []
+    {
+        Database db(Backend::PREAD, SyncMode::NONE, HashKind::MURMUR, noWal());
+        fill(db, kBenchRecords * 2);
+
+        const int64_t capacity = db.stats().capacity;
+        constexpr int32_t kRuns = 10;
+
+        auto rate = [&](const char* name, const size_t slot_bytes, const double seconds)
+        {
+            report << "  " << setw(12) << left << name << right << fixed << setprecision(1)
+                   << kRuns * capacity / seconds / 1e6 << " M slots/s, " << setprecision(2)
+                   << kRuns * static_cast<double>(capacity * slot_bytes) / seconds / 1e9 << " GB/s" << endl;
+        };
+
+        report << "Scans over " << capacity << " slots:" << endl;
+
+        auto start = chrono::steady_clock::now();
+
+        for (int32_t i = 0; i < kRuns; ++i)
+        {
+            db.findByPrice(-1.0);
+        }
+        rate("findByPrice", sizeof(double), secondsSince(start));
+
+        start = chrono::steady_clock::now();
+
+        for (int32_t i = 0; i < kRuns; ++i)
+        {
+            db.getAll();
+        }
+        rate("getAll", kRecordSize, secondsSince(start));
+    });
+}
+
+// findByPrice on the scan pool with 1, 2, 4 and 8 threads: once for a
+// price nothing has, which only reads the shadow column, and once for
+// one in a thousand records, which also reads their pages.
+static void benchScanThreads()
+{
+    report << "Scan pool, findByPrice over " << kBenchRecords * 2 << " records, "
+           << std::thread::hardware_concurrency() << " hardware threads:" << endl;
+
+    inFreshDirectory("threads", []
+    {
+        {
+            Database db(Backend::PREAD, SyncMode::NONE, HashKind::MURMUR, noWal());
+            fill(db, kBenchRecords * 2);
+        }
+
+        for (const int32_t threads : {1, 2, 4, 8})
+        {
+            Database db(Backend::PREAD, SyncMode::NONE, HashKind::MURMUR, noWal(), QueueOptions(), threads);
+            constexpr int32_t kRuns = 10;
+
+            report << "  " << threads << " threads:";
+
+            for (const double price : {-1.0, 420.0})
+            {
+                const auto start = chrono::steady_clock::now();
+
+                for (int32_t i = 0; i < kRuns; ++i)
+                {
+                    db.findByPrice(price);
+                }
+
+                report << (price < 0 ? " no match " : ", 0.1% match ") << fixed << setprecision(2)
+                       << secondsSince(start) / kRuns * 1e3 << " ms";
+            }
+            report << endl;
+        }
+    });
+}
+
+// Microseconds per call of f(i), for i from 0 to runs - 1.
+template <class F>
+static double microsPerQuery(const int32_t runs, F f)
+{
+    const auto start = chrono::steady_clock::now();
+
+    for (int32_t i = 0; i < runs; ++i)
+    {
+        f(i);
+    }
+
+    return secondsSince(start) / runs * 1e6;
+}
+
+// Price queries served by the B+tree next to the full scan findByPrice
+// does: one exact price, the cheapest 10 and a range holding about 0.1%
+// of the records.
+static void benchPriceRange()
+{
+    constexpr int32_t kRecords = kBenchRecords * 2;
+    constexpr int32_t kPrices = 100000;
+
+    report << "Price queries over " << kRecords << " records, us per query:" << endl;
+
+    inFreshDirectory("range", []
+    {
+        Database db(Backend::PREAD, SyncMode::NONE, HashKind::MURMUR, noWal());
+
+        for (int32_t id = 1; id <= kRecords; ++id)
+        {
+            db.insert(id, "item", (static_cast<int64_t>(id) * 7919 % kPrices) / 100.0, 1);
+        }
+
+        const double exact_index = microsPerQuery(1000, [&](const int32_t i)
+        {
+            const double price = (i * 97 % kPrices) / 100.0;
+            db.findByPriceRange(price, price, 0);
+        });
+        const double exact_scan = microsPerQuery(20, [&](const int32_t i)
+        {
+            db.findByPrice((i * 97 % kPrices) / 100.0);
+        });
+        const double cheapest = microsPerQuery(1000, [&](const int32_t)
+        {
+            db.findByPriceRange(-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(),
+                                10);
+        });
+        const double range = microsPerQuery(200, [&](const int32_t i)
+        {
+            const double low = (i * 97 % kPrices) / 100.0;
+            db.findByPriceRange(low, low + kPrices / 100.0 / 1000, 0);
+        });
+
+        report << "  exact, index " << fixed << setprecision(1) << exact_index << ", scan " << exact_scan
+               << "; cheapest 10 " << cheapest << "; 0.1% range " << range << endl;
+    });
+}
+
+// Title searches served by the title indexes, next to what answering
+// them by reading every record (getAll) costs.
+static void benchTitleSearch()
+{
+    constexpr int32_t kRecords = kBenchRecords * 2;
+    constexpr int32_t kTitles = 10000;
+
+    report << "Title searches over " << kRecords << " records, " << kTitles << " titles, us per query:" << endl;
+
+    inFreshDirectory("titles", []
+    {
+        Database db(Backend::PREAD, SyncMode::NONE, HashKind::MURMUR, noWal());
+
+        for (int32_t id = 1; id <= kRecords; ++id)
+        {
+            db.insert(id, "item" + to_string(id % kTitles), 1.0, 1);
+        }
+
+        const double scan = microsPerQuery(5, [&](const int32_t)
+        {
+            const string title = "item42";
+            const vector<Record> all = db.getAll();
+            return std::count_if(all.begin(), all.end(), [&](const Record& r) { return title == r.title; });
+        });
+        const double exact = microsPerQuery(1000, [&](const int32_t i)
+        {
+            db.findByTitle("item" + to_string(i * 97 % kTitles));
+        });
+
+        const double prefix = microsPerQuery(1000, [&](const int32_t i)
+        {
+            db.findByTitlePrefix("item" + to_string(i % 1000), 10);
+        });
+
+        const double substring = microsPerQuery(200, [&](const int32_t i)
+        {
+            db.findByTitleSubstring("m" + to_string(i * 97 % kTitles), 100);
+        });
+        const double fuzzy = microsPerQuery(200, [&](const int32_t i)
+        {
+            db.findByTitleFuzzy("itme" + to_string(i * 97 % kTitles), 2, 100);
+        });
+
+        report << "  getAll and compare " << fixed << setprecision(1) << scan << endl
+               << "  exact              " << exact << endl
+               << "  prefix, limit 10   " << prefix << endl
+               << "  substring          " << substring << endl
+               << "  fuzzy, 2 edits     " << fuzzy << endl;
+    });
+}
+
+// "How many are out of stock" from the quantity bitmaps, alone and ANDed
+// with a price range, next to fetching the matches with findByQuantity
+// and to counting over getAll.
+static void benchQuantityCounts()
+{
+    constexpr int32_t kRecords = kBenchRecords * 2;
+
+    report << "Quantity counts over " << kRecords << " records, 50 quantities, us per query:" << endl;
+
+    inFreshDirectory("counts", []
+    {
+        Database db(Backend::PREAD, SyncMode::NONE, HashKind::MURMUR, noWal());
+        fill(db, kRecords);
+
+        const double count = microsPerQuery(1000, [&](const int32_t) { db.countByQuantity(0, 0); });
+        const double priced = microsPerQuery(100, [&](const int32_t) { db.countByQuantity(0, 0, 100.0, 199.0); });
+        const double find = microsPerQuery(5, [&](const int32_t) { db.findByQuantity(0); });
+        const double scan = microsPerQuery(5, [&](const int32_t)
+        {
+            const vector<Record> all = db.getAll();
+            return std::count_if(all.begin(), all.end(), [](const Record& r) { return r.quantity == 0; });
+        });
+
+        report << "  count " << fixed << setprecision(1) << count << ", count with price range " << priced
+               << ", findByQuantity " << find << ", getAll and count " << scan << endl;
+    });
+}
+
+// findById after half the records were deleted: live ids, deleted ids
+// and ids that never existed. Misses the id filter turns away read no
+// page; the share that gets past it is the filter's false positives.
+static void benchIdFilter()
+{
+    report << "findById with the id filter, " << kBenchRecords << " records, half deleted:" << endl;
+
+    inFreshDirectory("filter", []
+    {
+        Database db(Backend::PREAD, SyncMode::NONE, HashKind::MURMUR, noWal());
+        fill(db, kBenchRecords);
+
+        for (int32_t id = 2; id <= kBenchRecords; id += 2)
+        {
+            db.deleteById(id);
+        }
+
+        constexpr int32_t kLookups = 100000;
+
+        const pair<const char*, int32_t> kinds[] = {{"live", 1}, {"deleted", 2}, {"never inserted", 0}};
+
+        for (const auto& [name, first] : kinds)
+        {
+            int64_t reads = 0;
+            int64_t past_filter = 0;
+
+            const double us = microsPerQuery(kLookups, [&, first = first](const int32_t i)
+            {
+                const int32_t id = first != 0 ? first + 2 * (i * 97 % (kBenchRecords / 2))
+                                              : kBenchRecords + 1 + i;
+                int disk_reads = 0;
+
+                db.findById(id, disk_reads);
+                reads += disk_reads;
+                past_filter += disk_reads != 0;
+            });
+
+            report << "  " << setw(15) << left << name << right << fixed << setprecision(2) << us << " us, "
+                   << setprecision(3) << static_cast<double>(reads) / kLookups << " reads, " << setprecision(2)
+                   << 100.0 * past_filter / kLookups << "% read a page" << endl;
+        }
+    });
+}
+
+// The predicate kernels alone, bucket by bucket over in-memory columns
+// as findBy runs them: the scalar versions against the ones scanKernels()
+// dispatches to on this CPU. Both must find the same matches.
+static void benchKernels()
+{
+    constexpr int32_t kBuckets = kBenchRecords * 4 / kBucketSlots;
+    constexpr int32_t kSlots = kBuckets * kBucketSlots;
+    constexpr int32_t kRuns = 20;
+
+    std::vector<int32_t> quantities(kSlots);
+    std::vector<double> prices(kSlots);
+    std::vector<Record> records(kSlots);
+
+    for (int32_t i = 0; i < kSlots; ++i)
+    {
+        quantities[i] = i % 50;
+        prices[i] = i % 1000;
+        records[i] = Record{i, {}, prices[i], quantities[i], false};
+        snprintf(records[i].title, sizeof(records[i].title), "item%d", i % 100);
+    }
+
+    char title[kTitleSize] = "item42";
+    const size_t len = strlen(title);
+    const ScanKernels& simd = scanKernels();
+
+    report << "Scan kernels over " << kSlots << " slots, scalar vs " << simd.name << ":" << endl;
+
+    auto run = [&](const char* name, const size_t slot_bytes, auto scalar, auto vector)
+    {
+        double seconds[2];
+        int64_t matches[2] = {0, 0};
+
+        for (int32_t k = 0; k < 2; ++k)
+        {
+            const auto start = chrono::steady_clock::now();
+
+            for (int32_t r = 0; r < kRuns; ++r)
+            {
+                for (int32_t b = 0; b < kBuckets; ++b)
+                {
+                    matches[k] += __builtin_popcountll(k == 0 ? scalar(b * kBucketSlots) : vector(b * kBucketSlots));
+                }
+            }
+            seconds[k] = secondsSince(start);
+        }
+
+        const double bytes = static_cast<double>(kRuns) * kSlots * slot_bytes;
+
+        report << "  " << setw(9) << left << name << right << fixed << setprecision(2) << bytes / seconds[0] / 1e9
+               << " GB/s scalar, " << bytes / seconds[1] / 1e9 << " GB/s " << simd.name << endl;
+
+        if (matches[0] != matches[1])
+        {
+            report << "  " << name << ": scalar found " << matches[0] << " matches, " << simd.name << " "
+                   << matches[1] << endl;
+            ++failures;
+        }
+    };
+
+    run("quantity", sizeof(int32_t),
+        [&](const int32_t first) { return matchQuantityScalar(&quantities[first], kBucketSlots, 42); },
+        [&](const int32_t first) { return simd.quantity(&quantities[first], kBucketSlots, 42); });
+    run("price", sizeof(double),
+        [&](const int32_t first) { return matchPriceScalar(&prices[first], kBucketSlots, 420.0); },
+        [&](const int32_t first) { return simd.price(&prices[first], kBucketSlots, 420.0); });
+    run("title", kTitleSize,
+        [&](const int32_t first) { return matchTitleScalar(&records[first], kBucketSlots, title, len); },
+        [&](const int32_t first) { return simd.title(&records[first], kBucketSlots, title, len); });
+}
+
+// What the shadow columns save: the same price and quantity tests run
+// bucket by bucket over the dense columns (findBy's path) and over the
+// records themselves, where every slot drags its title along. Both
+// use the scalar kernels and must find the same matches.
+static void benchShadows()
+{
+    constexpr int32_t kBuckets = kBenchRecords * 4 / kBucketSlots;
+    constexpr int32_t kSlots = kBuckets * kBucketSlots;
+    constexpr int32_t kRuns = 20;
+
+    std::vector<int32_t> quantities(kSlots);
+    std::vector<double> prices(kSlots);
+    std::vector<Record> records(kSlots);
+
+    for (int32_t i = 0; i < kSlots; ++i)
+    {
+        quantities[i] = i % 50;
+        prices[i] = i % 1000;
+        records[i] = Record{i, {}, prices[i], quantities[i], false};
+    }
+
+    report << "Shadow columns vs records, " << kSlots << " slots:" << endl;
+
+    auto run = [&](const char* name, auto column, auto record)
+    {
+        double seconds[2];
+        int64_t matches[2] = {0, 0};
+
+        for (int32_t k = 0; k < 2; ++k)
+        {
+            const auto start = chrono::steady_clock::now();
+
+            for (int32_t r = 0; r < kRuns; ++r)
+            {
+                for (int32_t b = 0; b < kBuckets; ++b)
+                {
+                    matches[k] += __builtin_popcountll(k == 0 ? column(b * kBucketSlots) : record(b * kBucketSlots));
+                }
+            }
+            seconds[k] = secondsSince(start);
+        }
+
+        report << "  " << setw(9) << left << name << right << fixed << setprecision(0)
+               << static_cast<double>(kRuns) * kSlots / seconds[0] / 1e6 << " M slots/s column, "
+               << static_cast<double>(kRuns) * kSlots / seconds[1] / 1e6 << " M slots/s records" << endl;
+
+        if (matches[0] != matches[1])
+        {
+            report << "  " << name << ": columns found " << matches[0] << " matches, records " << matches[1] << endl;
+            ++failures;
+        }
+    };
+
+    run("quantity",
+        [&](const int32_t first) { return matchQuantityScalar(&quantities[first], kBucketSlots, 42); },
+        [&](const int32_t first)
+        {
+            uint64_t mask = 0;
+
+            for (int32_t i = 0; i < kBucketSlots; ++i)
+            {
+                mask |= static_cast<uint64_t>(records[first + i].quantity == 42) << i;
+            }
+            return mask;
+        });
+    run("price",
+        [&](const int32_t first) { return matchPriceScalar(&prices[first], kBucketSlots, 420.0); },
+        [&](const int32_t first)
+        {
+            uint64_t mask = 0;
+
+            for (int32_t i = 0; i < kBucketSlots; ++i)
+            {
+                mask |= static_cast<uint64_t>(fabs(records[first + i].price - 420.0) < kPriceEpsilon) << i;
+            }
+            return mask;
+        });
+}
+
+int main()
+{
+    char dir[] = "/tmp/dp_bench_XXXXXX";
+
+    if (mkdtemp(dir) == nullptr || chdir(dir) != 0)
+    {
+        cerr << "Couldn't make a scratch directory" << endl;
+        return EXIT_FAILURE;
+    }
+
+    std::streambuf* out = cout.rdbuf(nullptr);
+
+    try
+    {
+        for (auto bench : {benchProbeLengths, benchLookupSyscalls, benchWalWriters, benchWriteQueue, benchBatchWindow,
+                           benchStress, benchReadsUnderWrites, benchScans, benchScanThreads, benchPriceRange,
+                           benchTitleSearch, benchQuantityCounts, benchIdFilter, benchKernels, benchShadows})
+        {
+            bench();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        cerr << "FAILED: " << e.what() << endl;
+        ++failures;
+    }
+
+    cout.rdbuf(out);
+    std::filesystem::remove_all(dir);
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,885 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <random>
+#include <set>
+#include <thread>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "Database.h"
+
+using namespace std;
+
+// Sanity checks for flows that cross the table and its index files. Run
+// with `make check`; works in a fresh temporary directory, so existing
+// store files are left alone.
+
+static int failures = 0;
+
+static void check(const bool ok, const char* what)
+{
+    if (!ok)
+    {
+        cerr << "FAILED: " << what << endl;
+        ++failures;
+    }
+}
+
+// drop() closes and removes every index file; restore() and clear() have
+// to bring them back before the next change touches them.
+static void checkDropRestore()
+{
+    Database db;
+
+    for (int32_t id = 1; id <= 500; ++id)
+    {
+        db.insert(id, "item" + to_string(id % 10), id, id % 7);
+    }
+
+    db.backup();
+    db.drop();
+    db.restore();
+
+    int disk_reads = 0;
+
+    check(db.insert(1000, "new", 5.5, 3), "insert after drop and restore");
+    check(db.findById(1000, disk_reads).has_value(), "findById after restore");
+    check(db.findByTitle("new").size() == 1, "findByTitle of the new record");
+    check(db.findByTitle("item3").size() == 50, "findByTitle of restored records");
+    check(db.findByPriceRange(5.0, 6.0, 0).size() == 3, "findByPriceRange after restore");
+    check(db.findByQuantity(3).size() == 73, "findByQuantity after restore");
+    check(db.countByQuantity(3, 3) == 73, "countByQuantity after restore");
+
+    db.drop();
+    db.clear();
+
+    check(db.insert(7, "x", 1.0, 1), "insert after drop and clear");
+    check(db.findByTitle("x").size() == 1, "findByTitle after clear");
+    check(db.findByPriceRange(0.0, 2.0, 0).size() == 1, "findByPriceRange after clear");
+}
+
+static void checkReopen()
+{
+    Database db;
+
+    check(db.findByTitle("x").size() == 1, "findByTitle after reopen");
+    check(db.findByPriceRange(0.0, 2.0, 0).size() == 1, "findByPriceRange after reopen");
+}
+
+// A store.db in the flat layout of earlier versions: header, then
+// capacity slots. It has to be converted on open, not rejected.
+static void checkLegacyUpgrade()
+{
+    std::filesystem::create_directory("legacy");
+    std::filesystem::current_path("legacy");
+
+    {
+        const int32_t capacity = 1000;
+        std::vector<Record> slots(capacity);
+
+        for (int32_t id = 1; id <= 600; ++id)
+        {
+            Record& record = slots[id % capacity];
+            record.id = id;
+            std::strcpy(record.title, id % 2 == 0 ? "even" : "odd");
+            record.price = id;
+            record.quantity = id % 5;
+            record.is_deleted = id % 100 == 0;
+        }
+
+        LegacyHeader header{capacity, 600};
+        std::ofstream out(kDbFile, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(slots.data()), static_cast<std::streamsize>(capacity) * kRecordSize);
+    }
+
+    {
+        Database db;
+        int disk_reads = 0;
+
+        check(db.getAll().size() == 594, "record count after converting an old file");
+        check(db.findById(7, disk_reads).has_value(), "findById after converting an old file");
+        check(!db.findById(100, disk_reads).has_value(), "deleted record stays deleted after converting");
+        check(db.findByTitle("odd").size() == 300, "findByTitle after converting an old file");
+        check(db.insert(601, "new", 1.0, 1), "insert after converting an old file");
+    }
+
+    {
+        Database db;
+
+        check(db.getAll().size() == 595, "record count after reopening a converted file");
+    }
+
+    std::filesystem::current_path("..");
+}
+
+// A resize cut short by closing the database: both files stay behind,
+// and the next open has to pick up moving records where it left off.
+static void checkResizeResume()
+{
+    std::filesystem::create_directory("resume");
+    std::filesystem::current_path("resume");
+
+    std::set<int32_t> expected;
+    int32_t next_id = 1;
+
+    auto allThere = [&](Database& db)
+    {
+        int disk_reads = 0;
+        bool all = db.getAll().size() == expected.size();
+
+        for (const int32_t id : expected)
+        {
+            all = all && db.findById(id, disk_reads).has_value();
+        }
+        return all;
+    };
+
+    {
+        Database db;
+
+        while (next_id <= 2000 || !db.stats().resizing)
+        {
+            db.insert(next_id, "resume", 1.0, 1);
+            expected.insert(next_id++);
+        }
+
+        for (int32_t i = 0; i < 10; ++i)
+        {
+            db.insert(next_id, "resume", 1.0, 1);
+            expected.insert(next_id++);
+        }
+
+        for (int32_t id = 3; id < next_id; id += 97)
+        {
+            db.deleteById(id);
+            expected.erase(id);
+        }
+
+        check(db.stats().resizing, "resize still running when closed");
+    }
+
+    check(std::filesystem::exists(kResizeFile), "both table files left by an unfinished resize");
+
+    {
+        Database db;
+
+        check(db.stats().resizing, "resize resumed after reopen");
+        check(allThere(db), "every record there while resuming a resize");
+
+        while (db.stats().resizing)
+        {
+            db.insert(next_id, "resume", 1.0, 1);
+            expected.insert(next_id++);
+        }
+
+        check(allThere(db), "every record there after a resumed resize");
+    }
+
+    {
+        Database db;
+
+        check(!std::filesystem::exists(kResizeFile), "resize file gone once the resize is done");
+        check(allThere(db), "every record there after reopening a resized table");
+    }
+
+    std::filesystem::current_path("..");
+}
+
+// One writer keeps sweeping over the records in id order, setting each
+// quantity to the number of the sweep. Any single point in time then
+// shows quantities that never rise with the id and differ by at most
+// one, which a scan running meanwhile has to reproduce.
+static void checkScanSnapshots()
+{
+    std::filesystem::create_directory("snapshots");
+    std::filesystem::current_path("snapshots");
+
+    {
+        WalOptions wal;
+        wal.enabled = false;
+        Database db(Backend::PREAD, SyncMode::NONE, HashKind::MURMUR, wal);
+
+        // Enough buckets for several scan chunks, which are locked one
+        // at a time.
+        constexpr int32_t kRecords = 40000;
+        constexpr int32_t kSweeps = 5;
+
+        for (int32_t id = 1; id <= kRecords; ++id)
+        {
+            db.insert(id, "snapshot", 1.0, 0);
+        }
+
+        std::atomic<bool> done{false};
+        int32_t scans = 0;
+        bool consistent = true;
+
+        std::thread writer([&]
+        {
+            for (int32_t sweep = 1; sweep <= kSweeps; ++sweep)
+            {
+                for (int32_t id = 1; id <= kRecords; ++id)
+                {
+                    db.update(id, "snapshot", 1.0, sweep);
+                }
+            }
+            done = true;
+        });
+
+        while (!done)
+        {
+            std::vector<Record> records = db.getAll();
+            std::sort(records.begin(), records.end(), [](const Record& a, const Record& b) { return a.id < b.id; });
+
+            bool ok = records.size() == kRecords;
+
+            for (size_t i = 1; ok && i < records.size(); ++i)
+            {
+                ok = records[i].id == records[i - 1].id + 1 && records[i].quantity <= records[i - 1].quantity;
+            }
+
+            consistent = consistent && ok && records.front().quantity - records.back().quantity <= 1;
+            ++scans;
+        }
+
+        writer.join();
+
+        check(scans > 1, "scans ran while the writer did");
+        check(consistent, "every scan sees one point in time");
+    }
+
+    std::filesystem::current_path("..");
+}
+
+// Fills a four-bucket table far enough that records spill over into the
+// next buckets, then erases them one by one in random order. Every
+// backward shift has to leave all the remaining records findable.
+static void checkBackwardShift()
+{
+    Table table("shift.db", Backend::PREAD, SyncMode::NONE, HashKind::MURMUR);
+    table.create(4 * kBucketSlots);
+
+    std::vector<int32_t> ids;
+
+    for (int32_t id = 1; static_cast<int32_t>(ids.size()) < 4 * kBucketSlots - 8; ++id)
+    {
+        Record record{};
+        record.id = id;
+
+        if (table.insert(record) == InsertStatus::OK)
+        {
+            ids.push_back(id);
+        }
+    }
+
+    check(table.probeStats().max_distance > 0, "records displaced before erasing");
+
+    std::mt19937 rng(7);
+    std::shuffle(ids.begin(), ids.end(), rng);
+
+    bool found = true;
+
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        table.erase(table.find(ids[i]));
+
+        for (size_t j = i + 1; j < ids.size(); ++j)
+        {
+            found = found && table.find(ids[j]) >= 0;
+        }
+        found = found && table.find(ids[i]) < 0;
+    }
+
+    check(found, "every survivor found after each backward shift");
+    check(table.count() == 0 && table.probeStats().live == 0, "table empty after erasing everything");
+
+    table.close();
+    std::filesystem::remove("shift.db");
+}
+
+// The id filter must never turn away a live id. A counter that reaches
+// 255 sticks there rather than wrap, so deletes can't bring it down to 0
+// under ids that still use it; only a rebuild from the live ids clears it.
+static void checkIdFilter()
+{
+    IdFilter filter;
+    RoaringBitmap live;
+    std::mt19937 rng(25);
+
+    for (int32_t i = 0; i < 20000; ++i)
+    {
+        live.add(rng() % 1000000 + 1);
+    }
+
+    filter.rebuild(40000, live);
+
+    constexpr int32_t kHot = 1000001;
+
+    for (int32_t i = 0; i < 300; ++i)
+    {
+        filter.add(kHot);
+    }
+    for (int32_t i = 0; i < 299; ++i)
+    {
+        filter.remove(kHot);
+    }
+
+    check(filter.mayContain(kHot), "saturated filter counters don't wrap into a false negative");
+
+    filter.remove(kHot);
+
+    bool all = true;
+    int32_t removed = 0;
+
+    live.forEach([&](const uint32_t id)
+    {
+        if (id % 2 == 0)
+        {
+            filter.remove(static_cast<int32_t>(id));
+            ++removed;
+        }
+    });
+
+    live.forEach([&](const uint32_t id)
+    {
+        all = all && (id % 2 == 0 || filter.mayContain(static_cast<int32_t>(id)));
+    });
+
+    check(all, "filter keeps every live id after deletes");
+
+    int32_t false_positives = 0;
+
+    for (int32_t id = 2000001; id <= 2100000; ++id)
+    {
+        false_positives += filter.mayContain(id);
+    }
+
+    check(false_positives < 5000, "filter turns away most absent ids");
+    check(filter.mayContain(kHot), "saturated counters stay set until a rebuild");
+
+    RoaringBitmap odd;
+    live.forEach([&](const uint32_t id)
+    {
+        if (id % 2 != 0)
+        {
+            odd.add(id);
+        }
+    });
+
+    filter.rebuild(40000, odd);
+
+    all = true;
+    odd.forEach([&](const uint32_t id) { all = all && filter.mayContain(static_cast<int32_t>(id)); });
+
+    check(all && !filter.mayContain(kHot), "filter rebuild keeps live ids and clears saturated counters");
+    check(removed > 0, "filter test removed some ids");
+}
+
+static int32_t levenshtein(const string& a, const string& b)
+{
+    std::vector<int32_t> row(b.size() + 1);
+    std::iota(row.begin(), row.end(), 0);
+
+    for (size_t i = 1; i <= a.size(); ++i)
+    {
+        int32_t diagonal = row[0];
+        row[0] = static_cast<int32_t>(i);
+
+        for (size_t j = 1; j <= b.size(); ++j)
+        {
+            const int32_t up = row[j];
+            row[j] = std::min({row[j] + 1, row[j - 1] + 1, diagonal + (a[i - 1] != b[j - 1])});
+            diagonal = up;
+        }
+    }
+
+    return row[b.size()];
+}
+
+// Substring and fuzzy matches from the trigram index against a scan of
+// every live title, on short titles over a small alphabet so that
+// queries match plenty of them. Checked after the initial build, after
+// titles come and go, and after enough die for the postings to be
+// compacted.
+static void checkTrigramSearch()
+{
+    TrigramIndex index;
+    std::map<string, int32_t> live;
+    std::mt19937 rng(23);
+
+    auto randomTitle = [&](const size_t min_len, const size_t max_len)
+    {
+        string title(min_len + rng() % (max_len - min_len + 1), ' ');
+
+        for (char& c : title)
+        {
+            c = "abcdxy"[rng() % 6];
+        }
+        return title;
+    };
+
+    for (int32_t i = 0; i < 3000; ++i)
+    {
+        ++live[randomTitle(1, 9)];
+    }
+
+    index.rebuild(std::vector<std::pair<string, int32_t>>(live.begin(), live.end()));
+
+    auto matches = [&]
+    {
+        bool ok = true;
+
+        for (int32_t q = 0; q < 100; ++q)
+        {
+            const string text = randomTitle(0, 5);
+            std::vector<string> expected;
+
+            for (const auto& [title, count] : live)
+            {
+                if (title.find(text) != string::npos)
+                {
+                    expected.push_back(title);
+                }
+            }
+
+            ok = ok && index.containing(text) == expected;
+        }
+
+        for (int32_t q = 0; q < 100; ++q)
+        {
+            const string query = randomTitle(1, 8);
+            const int32_t max_edits = static_cast<int32_t>(rng() % 3);
+            std::vector<std::pair<string, int32_t>> expected;
+
+            for (const auto& [title, count] : live)
+            {
+                const int32_t distance = levenshtein(query, title);
+
+                if (distance <= max_edits)
+                {
+                    expected.emplace_back(title, distance);
+                }
+            }
+
+            std::sort(expected.begin(), expected.end(), [](const auto& a, const auto& b)
+            {
+                return a.second < b.second || (a.second == b.second && a.first < b.first);
+            });
+
+            ok = ok && index.similar(query, max_edits) == expected;
+        }
+
+        return ok;
+    };
+
+    check(matches(), "trigram search matches a full scan after building");
+
+    for (int32_t i = 0; i < 2000; ++i)
+    {
+        const string title = randomTitle(1, 9);
+
+        if (rng() % 2 == 0)
+        {
+            index.insert(title.c_str());
+            ++live[title];
+        }
+        else if (live.count(title) != 0)
+        {
+            index.erase(title.c_str());
+
+            if (--live[title] == 0)
+            {
+                live.erase(title);
+            }
+        }
+    }
+
+    check(matches(), "trigram search matches a full scan after titles come and go");
+
+    while (live.size() > 200)
+    {
+        const auto it = std::next(live.begin(), rng() % live.size());
+
+        for (int32_t n = it->second; n > 0; --n)
+        {
+            index.erase(it->first.c_str());
+        }
+        live.erase(it);
+    }
+
+    check(matches(), "trigram search matches a full scan after compacting");
+}
+
+// Roaring containers switch from a sorted array to a bitmap above
+// kRoaringArrayMax values and back below it. Every step across that
+// line, and the set operations and serialization of both kinds, has to
+// agree with a plain set.
+static void checkRoaringTransitions()
+{
+    RoaringBitmap bitmap;
+    std::set<uint32_t> model;
+
+    auto same = [&](const RoaringBitmap& b, const std::set<uint32_t>& m)
+    {
+        std::vector<uint32_t> values;
+        b.forEach([&](const uint32_t v) { values.push_back(v); });
+
+        return b.cardinality() == static_cast<int64_t>(m.size()) &&
+               values == std::vector<uint32_t>(m.begin(), m.end());
+    };
+
+    auto roundTrip = [&]
+    {
+        std::vector<char> data;
+        bitmap.serialize(data);
+
+        RoaringBitmap copy;
+        size_t pos = 0;
+        return copy.deserialize(data, pos) && pos == data.size() && same(copy, model);
+    };
+
+    // Values in two containers: key 0 goes dense, key 3 stays sparse and
+    // moves the switch of key 0 by at most 100 from kRoaringArrayMax.
+    std::vector<uint32_t> values;
+
+    for (uint32_t low = 0; low < 6000; ++low)
+    {
+        values.push_back(low * 7 % 65536);
+    }
+    for (uint32_t low = 0; low < 100; ++low)
+    {
+        values.push_back((3u << 16) | (low * 13));
+    }
+
+    std::mt19937 rng(24);
+    std::shuffle(values.begin(), values.end(), rng);
+
+    bool ok = true;
+
+    for (const uint32_t v : values)
+    {
+        ok = ok && bitmap.add(v) == model.insert(v).second;
+
+        if (model.size() % 1000 == 0 || (model.size() > kRoaringArrayMax - 110 && model.size() < kRoaringArrayMax + 110))
+        {
+            ok = ok && same(bitmap, model) && roundTrip();
+        }
+    }
+
+    check(ok && same(bitmap, model) && roundTrip(), "roaring adds across the array to bitmap switch");
+    check(!bitmap.add(values.front()), "roaring add of a present value in a bitmap container");
+
+    RoaringBitmap sparse;
+    std::set<uint32_t> sparse_model;
+
+    for (uint32_t v = 0; v < 65536; v += 50)
+    {
+        sparse.add(v);
+        sparse_model.insert(v);
+    }
+    sparse.add((3u << 16) | 13);
+    sparse_model.insert((3u << 16) | 13);
+
+    RoaringBitmap both = bitmap;
+    both &= sparse;
+
+    std::set<uint32_t> both_model;
+    std::set_intersection(model.begin(), model.end(), sparse_model.begin(), sparse_model.end(),
+                          std::inserter(both_model, both_model.end()));
+
+    RoaringBitmap either = sparse;
+    either |= bitmap;
+
+    std::set<uint32_t> either_model = model;
+    either_model.insert(sparse_model.begin(), sparse_model.end());
+
+    check(same(both, both_model) && same(either, either_model), "roaring and/or of bitmap and array containers");
+
+    std::shuffle(values.begin(), values.end(), rng);
+    ok = true;
+
+    for (const uint32_t v : values)
+    {
+        ok = ok && bitmap.remove(v) == (model.erase(v) == 1);
+
+        if (model.size() % 1000 == 0 || (model.size() > kRoaringArrayMax - 110 && model.size() < kRoaringArrayMax + 110))
+        {
+            ok = ok && same(bitmap, model) && roundTrip();
+        }
+    }
+
+    check(ok && bitmap.empty() && !bitmap.remove(values.front()), "roaring removes across the bitmap to array switch");
+}
+
+// Grows the price B+tree to three levels, empties it again and fills it
+// once more, comparing ranges against a sorted copy of the keys on the
+// way. The shape comes from the header on disk after each flush().
+static void checkPriceTree()
+{
+    PriceIndex index("btree.idx");
+    index.open();
+    index.rebuild({});
+
+    auto header = [&]
+    {
+        index.flush();
+
+        IndexHeader result{};
+        std::ifstream in("btree.idx", std::ios::binary);
+        in.read(reinterpret_cast<char*>(&result), sizeof(result));
+        return result;
+    };
+
+    std::vector<PriceKey> keys;
+    std::mt19937 rng(20);
+
+    for (int32_t id = 1; id <= 50000; ++id)
+    {
+        keys.push_back({static_cast<double>(rng() % 5000) / 10, id});
+        index.insert(keys.back().price, id);
+    }
+
+    auto matches = [&](const double min, const double max, const size_t limit)
+    {
+        std::sort(keys.begin(), keys.end());
+        std::vector<int32_t> expected;
+
+        for (const PriceKey& key : keys)
+        {
+            if (key.price >= min && key.price <= max && (limit == 0 || expected.size() < limit))
+            {
+                expected.push_back(key.id);
+            }
+        }
+
+        return index.range(min, max, limit) == expected;
+    };
+
+    const IndexHeader grown = header();
+
+    check(grown.height >= 3 && grown.entries == 50000, "B+tree splits up to three levels");
+    check(matches(-1.0, 1000.0, 0) && matches(100.0, 100.5, 0) && matches(250.0, 499.9, 70),
+          "B+tree ranges after splits");
+
+    std::shuffle(keys.begin(), keys.end(), rng);
+
+    while (keys.size() > 3000)
+    {
+        index.erase(keys.back().price, keys.back().id);
+        keys.pop_back();
+    }
+
+    check(matches(-1.0, 1000.0, 0) && matches(100.0, 130.0, 0) && matches(0.0, 499.9, 500),
+          "B+tree ranges after emptied leaves are unlinked");
+
+    for (const PriceKey& key : keys)
+    {
+        index.erase(key.price, key.id);
+    }
+    keys.clear();
+
+    const IndexHeader emptied = header();
+
+    check(emptied.height == 1 && emptied.entries == 0 && emptied.free >= 0,
+          "B+tree root collapses to one leaf, pages go on the free list");
+    check(index.range(-1.0, 1000.0, 0).empty(), "empty B+tree has no range");
+
+    for (int32_t id = 1; id <= 50000; ++id)
+    {
+        keys.push_back({static_cast<double>(rng() % 5000) / 10, id});
+        index.insert(keys.back().price, id);
+    }
+
+    check(header().pages <= grown.pages, "B+tree reuses freed pages instead of growing the file");
+    check(matches(-1.0, 1000.0, 0), "B+tree ranges after refilling");
+
+    index.close();
+    std::filesystem::remove("btree.idx");
+}
+
+// A crash in the middle of Robin Hood moves, backward shifts and
+// migration blocks. A child process makes the changes and dies without a
+// checkpoint; then every other page it changed gets its old contents
+// back, as if those writes had never reached the disk. Reopening has to
+// bring back every acknowledged record anyway.
+static void checkTornMoves()
+{
+    std::filesystem::create_directory("torn");
+    std::filesystem::current_path("torn");
+
+    // 512 buckets at a load factor just under the 0.7 that makes them
+    // grow, so some home buckets overflow into their neighbours.
+    constexpr int32_t kBase = 16000;
+    std::map<int32_t, int32_t> expected;
+
+    {
+        Database db;
+
+        for (int32_t id = 1; id <= kBase; ++id)
+        {
+            db.insert(id, "torn", id, id % 1000);
+            expected[id] = id % 1000;
+        }
+
+        check(db.stats().max_probe > 0, "records displaced before the torn writes");
+    }
+
+    // Deletes shift records back, the first inserts move displaced ones
+    // on; the last ones start a resize and stop half way through moving
+    // the old buckets over.
+    auto change = [&](Database* db)
+    {
+        for (int32_t id = 1; id <= kBase; id += 50)
+        {
+            if (db != nullptr)
+            {
+                db->deleteById(id);
+            }
+            expected.erase(id);
+        }
+
+        for (int32_t id = 2; id <= kBase; id += 100)
+        {
+            if (db != nullptr)
+            {
+                db->update(id, "torn", id, 7);
+            }
+            expected[id] = 7;
+        }
+
+        for (int32_t id = kBase + 1; id <= kBase + 1000; ++id)
+        {
+            if (db != nullptr)
+            {
+                db->insert(id, "torn", id, id % 1000);
+            }
+            expected[id] = id % 1000;
+        }
+    };
+
+    const pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        Database db;
+        change(&db);
+        _exit(db.stats().resizing ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    int status = 0;
+    check(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+          "torn writes end inside a migration");
+
+    change(nullptr);
+
+    {
+        std::ifstream journal(kJournalFile, std::ios::binary);
+        JournalImage image;
+        int32_t images = 0;
+
+        while (journal.read(reinterpret_cast<char*>(&image), sizeof(image)))
+        {
+            if (images++ % 2 == 0)
+            {
+                std::fstream table(image.path, std::ios::binary | std::ios::in | std::ios::out);
+                table.seekp(static_cast<std::streamoff>(image.bucket + 1) * kPageSize);
+                table.write(reinterpret_cast<const char*>(&image.page), sizeof(image.page));
+            }
+        }
+
+        check(images > 2, "torn writes saved pages in the journal");
+    }
+
+    {
+        Database db;
+        int disk_reads = 0;
+        bool all = true;
+
+        for (const auto& [id, quantity] : expected)
+        {
+            const std::optional<Record> record = db.findById(id, disk_reads);
+            all = all && record.has_value() && record->quantity == quantity;
+        }
+
+        check(all, "every record is back after torn writes");
+        check(db.getAll().size() == expected.size(), "no extra records after torn writes");
+        check(!db.findById(51, disk_reads).has_value(), "deleted record stays deleted after torn writes");
+    }
+
+    std::filesystem::current_path("..");
+}
+
+template <class F>
+static bool throws(F f)
+{
+    try
+    {
+        f();
+    }
+    catch (const std::exception&)
+    {
+        return true;
+    }
+    return false;
+}
+
+// Every write to /dev/full fails with ENOSPC. A commit that couldn't write
+// its batch must keep failing instead of later counting it as durable.
+static void checkWalWriteFailure()
+{
+    Wal wal("/dev/full", std::chrono::microseconds(0), 64);
+    wal.open();
+
+    const uint64_t lsn = wal.append(WalEntry{});
+
+    check(throws([&] { wal.commit(lsn); }), "commit fails when the WAL can't be written");
+    check(throws([&] { wal.commit(lsn); }), "failed batch isn't durable on the next commit");
+
+    const uint64_t later = wal.append(WalEntry{});
+
+    check(throws([&] { wal.commit(later); }), "later commit doesn't skip the failed batch");
+}
+
+int main()
+{
+    char dir[] = "/tmp/dp_check_XXXXXX";
+
+    if (mkdtemp(dir) == nullptr || chdir(dir) != 0)
+    {
+        cerr << "Couldn't make a scratch directory" << endl;
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        checkDropRestore();
+        checkReopen();
+        checkLegacyUpgrade();
+        checkWalWriteFailure();
+        checkBackwardShift();
+        checkResizeResume();
+        checkScanSnapshots();
+        checkPriceTree();
+        checkRoaringTransitions();
+        checkTrigramSearch();
+        checkIdFilter();
+        checkTornMoves();
+    }
+    catch (const std::exception& e)
+    {
+        cerr << "FAILED: " << e.what() << endl;
+        ++failures;
+    }
+
+    std::filesystem::remove_all(dir);
+
+    cout << (failures == 0 ? "All checks passed" : "Some checks failed") << endl;
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <string>
 #include "httplib.h"
 #include "json.hpp"
@@ -24,10 +26,111 @@ json::array_t getArrayJson(const std::vector<Record>& records)
     return j_arr;
 }
 
-int main()
+// Search endpoints never return more than this many records per request.
+constexpr size_t kMaxSearchLimit = 10000;
+
+// Reads the optional "limit" field of a search request, fallback when it's
+// missing. 0 and anything above kMaxSearchLimit mean kMaxSearchLimit.
+// Returns false with a 400 response if it isn't a non-negative integer.
+bool readLimit(const json& j, const size_t fallback, size_t& limit, httplib::Response& res)
+{
+    const auto it = j.find("limit");
+    uint64_t value = fallback;
+
+    if (it != j.end())
+    {
+        if (!it->is_number_unsigned())
+        {
+            res.status = 400;
+            res.set_content("Limit must be an integer >= 0", "text/plain");
+            return false;
+        }
+        value = it->get<uint64_t>();
+    }
+
+    limit = value == 0 ? kMaxSearchLimit : static_cast<size_t>(std::min<uint64_t>(value, kMaxSearchLimit));
+    return true;
+}
+
+int main(int argc, char* argv[])
 {
+    Backend backend = Backend::PREAD;
+    SyncMode sync = SyncMode::NONE;
+    HashKind hash_kind = HashKind::MURMUR;
+    WalOptions wal;
+    QueueOptions queue;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+
+        if (arg == "--mmap")
+        {
+            backend = Backend::MMAP;
+        }
+        else if (arg == "--sync=async")
+        {
+            sync = SyncMode::ASYNC;
+        }
+        else if (arg == "--sync=sync")
+        {
+            sync = SyncMode::SYNC;
+        }
+        else if (arg == "--hash=murmur")
+        {
+            hash_kind = HashKind::MURMUR;
+        }
+        else if (arg == "--hash=xxhash")
+        {
+            hash_kind = HashKind::XXHASH;
+        }
+        else if (arg == "--no-wal")
+        {
+            wal.enabled = false;
+        }
+        else if (arg.rfind("--group-commit-us=", 0) == 0)
+        {
+            wal.window_us = std::stoi(arg.substr(arg.find('=') + 1));
+        }
+        else if (arg.rfind("--group-commit-max=", 0) == 0)
+        {
+            wal.max_group = std::stoi(arg.substr(arg.find('=') + 1));
+        }
+        else if (arg == "--write-queue")
+        {
+            queue.enabled = true;
+        }
+        else if (arg.rfind("--write-batch=", 0) == 0)
+        {
+            queue.max_batch = std::stoi(arg.substr(arg.find('=') + 1));
+        }
+        else if (arg.rfind("--write-window-us=", 0) == 0)
+        {
+            queue.window_us = std::stoi(arg.substr(arg.find('=') + 1));
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--mmap] [--sync=async|--sync=sync] [--hash=murmur|--hash=xxhash]"
+                      << " [--no-wal] [--group-commit-us=N] [--group-commit-max=N]"
+                      << " [--write-queue] [--write-batch=N] [--write-window-us=N]" << std::endl;
+            return 1;
+        }
+    }
+
     httplib::Server svr;
-    Database db;
+    std::unique_ptr<Database> opened;
+
+    try
+    {
+        opened = std::make_unique<Database>(backend, sync, hash_kind, wal, queue);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Couldn't open the database: " << e.what() << std::endl;
+        return 1;
+    }
+
+    Database& db = *opened;
 
     std::cout << "Server is starting at http://localhost:8080" << std::endl;
 
@@ -139,19 +242,19 @@ int main()
         {
             auto j = json::parse(req.body);
             int32_t reads = 0;
-            Record* record_ptr = db.findById(j["id"], reads);
+            const std::optional<Record> record = db.findById(j["id"], reads);
 
             json resp;
             resp["reads"] = reads;
 
-            if (record_ptr != nullptr)
+            if (record)
             {
                 resp["found"] = true;
                 resp["data"] = {
-                    {"id", record_ptr->id},
-                    {"title", record_ptr->title},
-                    {"price", record_ptr->price},
-                    {"quantity", record_ptr->quantity}
+                    {"id", record->id},
+                    {"title", record->title},
+                    {"price", record->price},
+                    {"quantity", record->quantity}
                 };
             }
             else
@@ -183,6 +286,73 @@ int main()
         }
     });
 
+    svr.Post("/api/search/title/prefix", [&](const httplib::Request& req, httplib::Response& res)
+    {
+        try
+        {
+            auto j = json::parse(req.body);
+            size_t limit = 0;
+
+            if (!readLimit(j, 10, limit, res))
+            {
+                return;
+            }
+
+            json j_arr = getArrayJson(db.findByTitlePrefix(j["prefix"], limit));
+            res.set_content(j_arr.dump(), "application/json");
+        }
+        catch (const std::exception& e)
+        {
+            res.status = 500;
+            res.set_content(e.what(), "text/plain");
+        }
+    });
+
+    svr.Post("/api/search/title/contains", [&](const httplib::Request& req, httplib::Response& res)
+    {
+        try
+        {
+            auto j = json::parse(req.body);
+            size_t limit = 0;
+
+            if (!readLimit(j, 0, limit, res))
+            {
+                return;
+            }
+
+            json j_arr = getArrayJson(db.findByTitleSubstring(j["text"], limit));
+            res.set_content(j_arr.dump(), "application/json");
+        }
+        catch (const std::exception& e)
+        {
+            res.status = 500;
+            res.set_content(e.what(), "text/plain");
+        }
+    });
+
+    svr.Post("/api/search/title/fuzzy", [&](const httplib::Request& req, httplib::Response& res)
+    {
+        try
+        {
+            auto j = json::parse(req.body);
+            const int32_t distance = j.value("distance", 1);
+            size_t limit = 0;
+
+            if (!readLimit(j, 0, limit, res))
+            {
+                return;
+            }
+
+            json j_arr = getArrayJson(db.findByTitleFuzzy(j["title"], distance, limit));
+            res.set_content(j_arr.dump(), "application/json");
+        }
+        catch (const std::exception& e)
+        {
+            res.status = 500;
+            res.set_content(e.what(), "text/plain");
+        }
+    });
+
     svr.Post("/api/search/price", [&](const httplib::Request& req, httplib::Response& res)
     {
         try
@@ -198,6 +368,30 @@ int main()
         }
     });
 
+    svr.Post("/api/search/price/range", [&](const httplib::Request& req, httplib::Response& res)
+    {
+        try
+        {
+            auto j = json::parse(req.body);
+            const double min = j.value("min", -std::numeric_limits<double>::infinity());
+            const double max = j.value("max", std::numeric_limits<double>::infinity());
+            size_t limit = 0;
+
+            if (!readLimit(j, 0, limit, res))
+            {
+                return;
+            }
+
+            json j_arr = getArrayJson(db.findByPriceRange(min, max, limit));
+            res.set_content(j_arr.dump(), "application/json");
+        }
+        catch (const std::exception& e)
+        {
+            res.status = 500;
+            res.set_content(e.what(), "text/plain");
+        }
+    });
+
     svr.Post("/api/search/quantity", [&](const httplib::Request& req, httplib::Response& res)
     {
         try
@@ -213,6 +407,26 @@ int main()
         }
     });
 
+    svr.Post("/api/count/quantity", [&](const httplib::Request& req, httplib::Response& res)
+    {
+        try
+        {
+            auto j = json::parse(req.body);
+            const int32_t min = j.value("min", std::numeric_limits<int32_t>::min());
+            const int32_t max = j.value("max", std::numeric_limits<int32_t>::max());
+            const double price_min = j.value("price_min", -std::numeric_limits<double>::infinity());
+            const double price_max = j.value("price_max", std::numeric_limits<double>::infinity());
+
+            json j_count = {{"count", db.countByQuantity(min, max, price_min, price_max)}};
+            res.set_content(j_count.dump(), "application/json");
+        }
+        catch (const std::exception& e)
+        {
+            res.status = 500;
+            res.set_content(e.what(), "text/plain");
+        }
+    });
+
     svr.Post("/api/delete/id", [&](const httplib::Request& req, httplib::Response& res)
     {
         try
@@ -303,6 +517,40 @@ int main()
         }
     });
 
+    svr.Get("/api/stats", [&](const auto&, auto& res)
+    {
+        try
+        {
+            const DbStats stats = db.stats();
+
+            json resp = {
+                {"count", stats.count},
+                {"capacity", stats.capacity},
+                {"resizing", stats.resizing},
+                {"max_probe", stats.max_probe},
+                {"mean_probe", stats.mean_probe},
+                {"max_probe_slots", stats.max_probe_slots},
+                {"mean_probe_slots", stats.mean_probe_slots},
+                {"probe_histogram", stats.probe_histogram},
+                {"wal_entries", stats.wal.entries},
+                {"wal_syncs", stats.wal.syncs},
+                {"queue_depth", stats.queue.depth},
+                {"queue_max_depth", stats.queue.max_depth},
+                {"queue_batches", stats.queue.batches},
+                {"queue_max_batch", stats.queue.max_batch},
+                {"queue_mean_batch", stats.queue.batches == 0 ? 0.0
+                                     : static_cast<double>(stats.queue.ops) / stats.queue.batches},
+                {"scan_kernels", scanKernels().name}
+            };
+            res.set_content(resp.dump(), "application/json");
+        }
+        catch (const std::exception& e)
+        {
+            res.status = 500;
+            res.set_content(e.what(), "text/plain");
+        }
+    });
+
     svr.Post("/api/clear", [&](const auto&, auto& res)
     {
         try